@@ -1,6 +1,21 @@
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 typedef enum _TokenType {
     IntLit,
@@ -26,41 +41,64 @@ typedef enum _TokenType {
     Newline,
     Comma,
     Comment,
+    IfKeyword,
+    LoopKeyword,
+    BreakKeyword,
+    EndOfInput,
 } TokenType;
 
 typedef enum _TokenizeErrorType {
     LexSuccess = 0,
-    IdTooLong,
-    NumberTooLong,
-    StrTooLong,
-    CommentTooLong,
+    UnterminatedStr,
     UnknownChar,
+    ReadFailed,
 } TokenizeErrorType;
 
-typedef struct _Location {
-    int startOffset;
-    int endOffset;
-    int startLine;
-    int endLine;
-    int startChar;
-    int endChar;
-} Location;
-
-typedef struct _Token {
-    TokenType type;
-    char *text;
-    Location location;
-} Token;
+// A mapped source file, or an fd to be streamed when fd is not -1
+typedef struct _Source {
+    char *data;
+    size_t len;
+    int fd;
+} Source;
+
+typedef uint32_t Symbol;
+
+typedef struct _Buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+typedef struct _Slice {
+    char *chars;
+    int len;
+} Slice;
 
-typedef struct _TokenList {
-    Token *token;
-    struct _TokenList *next;
-} TokenList;
+// Tokens are kept as parallel arrays indexed by token position. Each token
+// is the slice [offsets[i], offsets[i] + lengths[i]) of the source; the
+// array is terminated by an EndOfInput token that is not counted. values
+// carries what the parser needs without going back to the source: the
+// value of an integer, and the interned symbol of an identifier, a string
+// literal's decoded body or a comment's text. Lines are not stored per
+// token: the lexer records the offset each line starts at, and line and
+// column are looked up from an offset when needed.
+typedef struct _TokenArray {
+    TokenType *types;
+    uint32_t *values;
+    int64_t *offsets;
+    int *lengths;
+    int count;
+    int capacity;
+    int allocations;
+    int64_t *lineStarts;
+    int lineCount;
+    int lineCapacity;
+} TokenArray;
 
 typedef struct _TokenizeErrorInfo {
-    int offset;
-    int line;
-    int character;
+    int64_t offset;
+    int64_t line;
+    int64_t character;
 } TokenizeErrorInfo;
 
 typedef enum _NodeType {
@@ -84,1185 +122,6516 @@ typedef enum _ParseError {
     ParseExtraTokens,
 } ParseError;
 
-struct VarAssignData {
-    struct _Node *varType;
-    struct _Node *varName;
-    struct _Node *initValue;
-};
-
-struct FunCallData {
-    struct _Node *funName;
-    struct _NodeList *args;
-};
-
-struct ProgramData {
-    struct _NodeList *statements;
-};
+typedef uint32_t NodeIndex;
 
 struct BinOpData {
-    struct _Node *lhs;
-    int op; // TokenType that ends in Op
-    struct _Node *rhs;
+    NodeIndex lhs;
+    NodeIndex rhs;
 };
 
-struct IfStatementData {
-    struct _Node *cond;
-    struct _NodeList *consequent;
+struct ChildrenData {
+    uint32_t start;
+    uint32_t count;
 };
 
-struct LoopStatementData {
-    struct _NodeList *body;
+// slot is the frame slot of the variable an Identifier names, filled in by
+// resolveProgram
+struct NameData {
+    Symbol id;
+    uint32_t slot;
 };
 
+// Nodes of a tree live in one Ast and refer to each other by index. Leaves
+// keep their value in data, a BinaryOp its operands in data.binOp, and
+// every other node its children in Ast.extra from data.children.start:
+//   VarAssign      TypeIdentifier, Identifier, value
+//   FunCall        Identifier, arguments...
+//   IfStatement    condition, statements...
+//   LoopStatement  statements...
+//   Program        statements...
+// A node spans length bytes of the source from offset start; lines and
+// columns are looked up in the line starts of the tokens when needed.
 typedef struct _Node {
-    NodeType type;
-    Location location;
+    uint8_t type;
+    uint8_t op; // TokenType of a BinaryOp
+    uint8_t valueType; // ValueType of an expression, set by checkProgram
+    uint32_t length;
     union {
-        struct VarAssignData varAssign;
-        struct FunCallData funCall;
-        struct ProgramData program;
         struct BinOpData binOp;
-        struct IfStatementData ifStatement;
-        struct LoopStatementData loopStatement;
-        char *id;
+        struct ChildrenData children;
+        struct NameData name;
         int val;
-        char *str;
+        Symbol str;
     } data;
+    int64_t start;
 } Node;
 
-typedef struct _NodeList {
-    Node *node;
-    struct _NodeList *next;
-} NodeList;
+// scratch holds the items of lists that are still being parsed, since a
+// list can only be copied into extra once all of it is known
+typedef struct _Ast {
+    Node *nodes;
+    int count;
+    int capacity;
+    NodeIndex *extra;
+    int extraCount;
+    int extraCapacity;
+    NodeIndex *scratch;
+    int scratchCount;
+    int scratchCapacity;
+    int allocations;
+} Ast;
+
+typedef struct _PhaseStats {
+    const char *name;
+    double wallStart;
+    double cpuStart;
+    double wall;
+    double cpu;
+    size_t bytes;
+} PhaseStats;
+
+#define MAX_PHASES 12
+
+// How lex and parse write what they found: as indented text, as one JSON
+// value or as one S-expression
+typedef enum _DumpFormat {
+    DumpText,
+    DumpJson,
+    DumpSexp,
+} DumpFormat;
+
+// Collected by the lex and parse commands when --stats is given
+typedef struct _Stats {
+    PhaseStats phases[MAX_PHASES];
+    int phaseCount;
+    int tokenCount;
+    int nodeCounts[BreakStatement + 1];
+    int optimized;
+    int removedNodes;
+} Stats;
+
+// Bump allocator for strings made at run time
+typedef struct _ArenaChunk {
+    struct _ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+typedef struct _Arena {
+    ArenaChunk *first;
+    ArenaChunk *current;
+    int chunkCount;
+    size_t reserved;
+} Arena;
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+// Where an interned name sits in Interner.chars
+typedef struct _SymbolName {
+    int64_t offset;
+    int len;
+} SymbolName;
+
+// Maps identifier text to dense 32-bit symbols. slots is an open-addressed
+// table of symbol + 1, with 0 marking an empty slot; the names themselves
+// are copied one after another, NUL-terminated, into chars. Names are found
+// by offset rather than by pointer so that an interner holds no addresses
+// and can be written to the AST cache and mapped back in as it is.
+typedef struct _Interner {
+    SymbolName *names;
+    uint32_t *hashes;
+    int count;
+    int capacity;
+    Symbol *slots;
+    int slotCount;
+    int allocations;
+    Buffer chars;
+} Interner;
+
+// State carried from one chunk to the next by lexChunk. Offsets are 64-bit
+// so that sources over 2 GB can be lexed.
+typedef struct _Lexer {
+    Interner *interner;
+    TokenArray *tokens;
+    int64_t baseOffset;
+    Buffer scratch;
+} Lexer;
+
+// Parse functions take a token position and return the position after what
+// they matched in *posLeft, so backtracking is just reusing an index.
+typedef struct _Parser {
+    Source *source;
+    TokenArray *tokens;
+    Ast *ast;
+    Interner *interner;
+} Parser;
+
+ArenaChunk *createArenaChunk(Arena *arena, size_t size) {
+    ArenaChunk *chunk = malloc(sizeof (ArenaChunk) + size);
+    arena->chunkCount++;
+    arena->reserved += size;
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+void initArena(Arena *arena) {
+    arena->chunkCount = 0;
+    arena->reserved = 0;
+    arena->first = createArenaChunk(arena, ARENA_CHUNK_SIZE);
+    arena->current = arena->first;
+}
+
+void *arenaAlloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaChunk *chunk = arena->current;
+    if (chunk->used + size > chunk->size) {
+        ArenaChunk *next = createArenaChunk(arena, size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+        chunk->next = next;
+        arena->current = next;
+        chunk = next;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void freeArena(Arena *arena) {
+    ArenaChunk *chunk = arena->first;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+uint32_t hashBytes(char *chars, int len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char)chars[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void initInterner(Interner *interner) {
+    interner->count = 0;
+    interner->capacity = 256;
+    interner->names = malloc(sizeof (SymbolName) * interner->capacity);
+    interner->hashes = malloc(sizeof (uint32_t) * interner->capacity);
+    interner->slotCount = 512;
+    interner->slots = calloc(interner->slotCount, sizeof (Symbol));
+    interner->chars.cap = 64 * 1024;
+    interner->chars.len = 0;
+    interner->chars.data = malloc(interner->chars.cap);
+    interner->allocations = 4;
+}
+
+void freeInterner(Interner *interner) {
+    free(interner->names);
+    free(interner->hashes);
+    free(interner->slots);
+    free(interner->chars.data);
+}
+
+void growInternerSlots(Interner *interner) {
+    int slotCount = interner->slotCount * 2;
+    Symbol *slots = calloc(slotCount, sizeof (Symbol));
+    for (int i = 0; i < interner->count; i++) {
+        uint32_t slot = interner->hashes[i] & (slotCount - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (slotCount - 1);
+        }
+        slots[slot] = i + 1;
+    }
+    free(interner->slots);
+    interner->allocations++;
+    interner->slots = slots;
+    interner->slotCount = slotCount;
+}
+
+Symbol intern(Interner *interner, char *chars, int len) {
+    uint32_t hash = hashBytes(chars, len);
+    uint32_t mask = interner->slotCount - 1;
+    uint32_t slot = hash & mask;
+    while (interner->slots[slot] != 0) {
+        Symbol symbol = interner->slots[slot] - 1;
+        SymbolName *name = &interner->names[symbol];
+        if (interner->hashes[symbol] == hash &&
+            name->len == len &&
+            memcmp(interner->chars.data + name->offset, chars, len) == 0) {
+            return symbol;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (interner->count == interner->capacity) {
+        interner->capacity *= 2;
+        interner->names = realloc(interner->names, sizeof (SymbolName) * interner->capacity);
+        interner->hashes = realloc(interner->hashes, sizeof (uint32_t) * interner->capacity);
+        interner->allocations += 2;
+    }
+    Symbol symbol = interner->count++;
+    Buffer *names = &interner->chars;
+    if (names->len + len + 1 > names->cap) {
+        while (names->len + len + 1 > names->cap) {
+            names->cap *= 2;
+        }
+        names->data = realloc(names->data, names->cap);
+        interner->allocations++;
+    }
+    SymbolName *name = &interner->names[symbol];
+    name->offset = names->len;
+    name->len = len;
+    memcpy(names->data + names->len, chars, len);
+    names->data[names->len + len] = 0;
+    names->len += len + 1;
+    interner->hashes[symbol] = hash;
+    interner->slots[slot] = symbol + 1;
+    // Keep the load factor at or below one half
+    if (interner->count * 2 > interner->slotCount) {
+        growInternerSlots(interner);
+    }
+    return symbol;
+}
+
+Slice symbolName(Interner *interner, Symbol symbol) {
+    SymbolName *name = &interner->names[symbol];
+    Slice slice;
+    slice.chars = interner->chars.data + name->offset;
+    slice.len = name->len;
+    return slice;
+}
+
+// The distinct string literals of one program with their lengths, in the
+// order they are first used. Literals are interned, so text that repeats
+// has a single symbol and so a single entry here.
+typedef struct _StringPool {
+    // Pool index + 1 of each symbol, or 0 when it is not in the pool
+    int *indexes;
+    Slice *strings;
+    int count;
+    int capacity;
+} StringPool;
+
+void initStringPool(StringPool *pool, Interner *interner) {
+    pool->indexes = calloc(interner->count + 1, sizeof (int));
+    pool->capacity = 16;
+    pool->count = 0;
+    pool->strings = malloc(sizeof (Slice) * pool->capacity);
+}
+
+void freeStringPool(StringPool *pool) {
+    free(pool->indexes);
+    free(pool->strings);
+}
+
+// Returns the pool index of the literal symbol, adding it on first use
+int poolString(StringPool *pool, Interner *interner, Symbol symbol) {
+    if (pool->indexes[symbol] == 0) {
+        if (pool->count == pool->capacity) {
+            pool->capacity *= 2;
+            pool->strings = realloc(pool->strings, sizeof (Slice) * pool->capacity);
+        }
+        pool->strings[pool->count++] = symbolName(interner, symbol);
+        pool->indexes[symbol] = pool->count;
+    }
+    return pool->indexes[symbol] - 1;
+}
+
+// The keyword lengths are all different, so the length alone is a perfect
+// hash for them and a single memcmp settles it.
+TokenType keywordType(char *chars, int len) {
+    static const struct {
+        char *text;
+        TokenType type;
+    } keywords[] = {
+        [2] = { "if", IfKeyword },
+        [4] = { "loop", LoopKeyword },
+        [5] = { "break", BreakKeyword },
+    };
+    if (len < (int)(sizeof keywords / sizeof keywords[0]) &&
+        keywords[len].text != NULL &&
+        memcmp(chars, keywords[len].text, len) == 0) {
+        return keywords[len].type;
+    }
+    return Id;
+}
+
+typedef struct _BinaryOpInfo {
+    int prec;
+    int rightAssoc;
+    char *text;
+} BinaryOpInfo;
+
+// Precedence and associativity of every binary operator token, indexed by
+// TokenType. A prec of 0 means the token does not continue an expression;
+// AssignOp only appears in VarAssign statements.
+static const BinaryOpInfo binaryOps[EndOfInput + 1] = {
+    [EqualOp] = { 1, 0, "==" },
+    [LessThan] = { 1, 0, "<" },
+    [LessThanOrEqual] = { 1, 0, "<=" },
+    [GreaterThan] = { 1, 0, ">" },
+    [GreaterThanOrEqual] = { 1, 0, ">=" },
+    [AddOp] = { 2, 0, "+" },
+    [SubtractOp] = { 2, 0, "-" },
+    [MultiplyOp] = { 3, 0, "*" },
+    [DivideOp] = { 3, 0, "/" },
+};
+
+typedef enum _CharClass {
+    CharUnknown = 0,
+    CharSpace,
+    CharNewline,
+    CharDigit,
+    CharAlpha,
+    CharQuote,
+    CharHash,
+    CharCompare,
+    CharSingle,
+} CharClass;
+
+// Classes every byte for the main lexer loop. Bytes outside ASCII and
+// control characters other than newline are unknown.
+static const unsigned char charClasses[256] = {
+    [' '] = CharSpace,
+    ['\n'] = CharNewline,
+    ['0' ... '9'] = CharDigit,
+    ['a' ... 'z'] = CharAlpha,
+    ['A' ... 'Z'] = CharAlpha,
+    ['"'] = CharQuote,
+    ['#'] = CharHash,
+    ['='] = CharCompare,
+    ['<'] = CharCompare,
+    ['>'] = CharCompare,
+    ['+'] = CharSingle,
+    ['-'] = CharSingle,
+    ['/'] = CharSingle,
+    ['*'] = CharSingle,
+    ['('] = CharSingle,
+    [')'] = CharSingle,
+    ['{'] = CharSingle,
+    ['}'] = CharSingle,
+    ['['] = CharSingle,
+    [']'] = CharSingle,
+    ['.'] = CharSingle,
+    [','] = CharSingle,
+};
 
-#define BUFFER_LEN 100
+static const TokenType singleCharTokens[256] = {
+    ['+'] = AddOp,
+    ['-'] = SubtractOp,
+    ['/'] = DivideOp,
+    ['*'] = MultiplyOp,
+    ['('] = LeftParan,
+    [')'] = RightParan,
+    ['{'] = LeftBrace,
+    ['}'] = RightBrace,
+    ['['] = LeftBracket,
+    [']'] = RightBracket,
+    ['.'] = Dot,
+    [','] = Comma,
+};
 
 int isAlpha(char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    return charClasses[(unsigned char)c] == CharAlpha;
 }
 
 int isDigit(char c) {
-    return c >= '0' && c <= '9';
-}
-
-int isOperator(TokenType type) {
-    return type == AddOp ||
-        type == SubtractOp ||
-        type == DivideOp ||
-        type == MultiplyOp ||
-        type == EqualOp ||
-        type == GreaterThan ||
-        type == GreaterThanOrEqual ||
-        type == LessThan ||
-        type == LessThanOrEqual;
-}
-
-int printToken(Token *token, int details) {
-    printf("Token(");
-    switch (token->type) {
-        case Id:
-            printf("ID,");
-            break;
-        case AssignOp:
-            printf("AssignOp");
-            break;
-        case AddOp:
-            printf("AddOp");
-            break;
-        case SubtractOp:
-            printf("SubtractOp");
-            break;
-        case DivideOp:
-            printf("DivideOp");
-            break;
-        case MultiplyOp:
-            printf("MultiplyOp");
-            break;
-        case IntLit:
-            printf("IntLit,");
-            break;
-        case StrLit:
-            printf("StrLit,");
-            break;
-        case LeftParan:
-            printf("LeftParan");
-            break;
-        case RightParan:
-            printf("RightParan");
-            break;
-        case LeftBrace:
-            printf("LeftBrace");
-            break;
-        case RightBrace:
-            printf("RightBrace");
-            break;
-        case LeftBracket:
-            printf("LeftBracket");
-            break;
-        case RightBracket:
-            printf("RightBracket");
-            break;
-        case EqualOp:
-            printf("EqualOp");
-            break;
-        case LessThan:
-            printf("LessThan");
-            break;
-        case LessThanOrEqual:
-            printf("LessThanOrEqual");
-            break;
-        case GreaterThan:
-            printf("GreaterThan");
-            break;
-        case GreaterThanOrEqual:
-            printf("GreaterThanOrEqual");
-            break;
-        case Dot:
-            printf("Dot");
-            break;
-        case Comma:
-            printf("Comma");
-            break;
-        case Comment:
-            printf("Comment");
-            break;
-        case Newline:
-            printf("Newline");
-            break;
-        default:
-            printf("Unknown");
+    return charClasses[(unsigned char)c] == CharDigit;
+}
+
+// Run scanners. Each returns the first position in [p, end) that does not
+// continue the run, or end. Whole vectors are tested at a time with AVX2 or
+// SSE2 when the compiler targets them, finishing with the scalar loop.
+#if defined(__AVX2__)
+typedef __m256i SimdVec;
+#define SIMD_WIDTH 32
+#define SIMD_ALL_BITS 0xffffffffu
+#define simdLoad(p) _mm256_loadu_si256((const __m256i *)(p))
+#define simdSet(c) _mm256_set1_epi8(c)
+#define simdEq(a, b) _mm256_cmpeq_epi8(a, b)
+#define simdLess(a, b) _mm256_cmpgt_epi8(b, a)
+#define simdOr(a, b) _mm256_or_si256(a, b)
+#define simdAdd(a, b) _mm256_add_epi8(a, b)
+#define simdBits(v) ((uint32_t)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+typedef __m128i SimdVec;
+#define SIMD_WIDTH 16
+#define SIMD_ALL_BITS 0xffffu
+#define simdLoad(p) _mm_loadu_si128((const __m128i *)(p))
+#define simdSet(c) _mm_set1_epi8(c)
+#define simdEq(a, b) _mm_cmpeq_epi8(a, b)
+#define simdLess(a, b) _mm_cmplt_epi8(a, b)
+#define simdOr(a, b) _mm_or_si128(a, b)
+#define simdAdd(a, b) _mm_add_epi8(a, b)
+#define simdBits(v) ((uint32_t)_mm_movemask_epi8(v))
+#endif
+
+#ifdef SIMD_WIDTH
+// Lanes holding a byte in [low, low + count), as a signed compare after
+// shifting the range down to start at -128
+static inline SimdVec simdInRange(SimdVec v, char low, int count) {
+    SimdVec shifted = simdAdd(v, simdSet((char)(-128 - low)));
+    return simdLess(shifted, simdSet((char)(-128 + count)));
+}
+#endif
+
+static inline char *scanAlpha(char *p, char *end) {
+#ifdef SIMD_WIDTH
+    while (end - p >= SIMD_WIDTH) {
+        // Setting bit 5 folds upper case onto lower case
+        SimdVec folded = simdOr(simdLoad(p), simdSet(0x20));
+        uint32_t stop = ~simdBits(simdInRange(folded, 'a', 26)) & SIMD_ALL_BITS;
+        if (stop != 0) {
+            return p + __builtin_ctz(stop);
+        }
+        p += SIMD_WIDTH;
     }
-    if (token->text != NULL) {
-        printf("%s", token->text);
+#endif
+    while (p < end && charClasses[(unsigned char)*p] == CharAlpha) {
+        p++;
     }
-    if (details) {
-        printf(",%d,%d,%d,%d,%d,%d",
-            token->location.startOffset, token->location.endOffset,
-            token->location.startLine, token->location.endLine,
-            token->location.startChar, token->location.endChar
-        );
+    return p;
+}
+
+static inline char *scanDigits(char *p, char *end) {
+#ifdef SIMD_WIDTH
+    while (end - p >= SIMD_WIDTH) {
+        uint32_t stop = ~simdBits(simdInRange(simdLoad(p), '0', 10)) & SIMD_ALL_BITS;
+        if (stop != 0) {
+            return p + __builtin_ctz(stop);
+        }
+        p += SIMD_WIDTH;
     }
-    printf(")");
-    printf("\n");
+#endif
+    while (p < end && charClasses[(unsigned char)*p] == CharDigit) {
+        p++;
+    }
+    return p;
+}
 
-    return 0;
+static inline char *scanSpaces(char *p, char *end) {
+#ifdef SIMD_WIDTH
+    while (end - p >= SIMD_WIDTH) {
+        uint32_t stop = ~simdBits(simdEq(simdLoad(p), simdSet(' '))) & SIMD_ALL_BITS;
+        if (stop != 0) {
+            return p + __builtin_ctz(stop);
+        }
+        p += SIMD_WIDTH;
+    }
+#endif
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    return p;
 }
 
-void tokenListAppend(
-    TokenList **tokens,
-    TokenList **tokensTail,
-    Token *token
-) {
-    // Append to the end of tokens linked list
-    if (*tokens == NULL) {
-        *tokens = malloc(sizeof (TokenList));
-        *tokensTail = *tokens;
-    } else {
-        (*tokensTail)->next = malloc(sizeof (TokenList));
-        (*tokensTail) = (*tokensTail)->next;
+// Stops at the closing quote, a backslash or a newline inside a string
+static inline char *scanStrBody(char *p, char *end) {
+#ifdef SIMD_WIDTH
+    while (end - p >= SIMD_WIDTH) {
+        SimdVec v = simdLoad(p);
+        uint32_t stop = simdBits(simdOr(
+            simdOr(simdEq(v, simdSet('"')), simdEq(v, simdSet('\\'))),
+            simdEq(v, simdSet('\n'))
+        ));
+        if (stop != 0) {
+            return p + __builtin_ctz(stop);
+        }
+        p += SIMD_WIDTH;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\' && *p != '\n') {
+        p++;
     }
-    (*tokensTail)->token = token;
-    (*tokensTail)->next = NULL;
+    return p;
 }
 
-Token *createToken(
-    TokenType type,
-    char *text,
-    int startOffset,
-    int startLine,
-    int startChar
-) {
-    Token *token = malloc(sizeof (Token));
-    token->type = type;
-    token->text = text;
-    token->location.startOffset = startOffset;
-    token->location.endOffset = startOffset;
-    token->location.startLine = startLine;
-    token->location.endLine = startLine;
-    token->location.startChar = startChar;
-    token->location.endChar = startChar;
-    return token;
-}
-
-Token *createTokenLong(
-    TokenType type,
-    char *text,
-    int startOffset,
-    int endOffset,
-    int startLine,
-    int endLine,
-    int startChar,
-    int endChar
-) {
-    Token *token = malloc(sizeof (Token));
-    token->type = type;
-    token->text = text;
-    token->location.startOffset = startOffset;
-    token->location.endOffset = endOffset;
-    token->location.startLine = startLine;
-    token->location.endLine = endLine;
-    token->location.startChar = startChar;
-    token->location.endChar = endChar;
-    return token;
+static inline char *scanToNewline(char *p, char *end) {
+#ifdef SIMD_WIDTH
+    while (end - p >= SIMD_WIDTH) {
+        uint32_t stop = simdBits(simdEq(simdLoad(p), simdSet('\n')));
+        if (stop != 0) {
+            return p + __builtin_ctz(stop);
+        }
+        p += SIMD_WIDTH;
+    }
+#endif
+    while (p < end && *p != '\n') {
+        p++;
+    }
+    return p;
 }
 
-int tokenize(
-    FILE *file,
-    TokenList **tokensRetval,
-    TokenizeErrorInfo *errorInfo
-) {
-    char chr;
-    char buffer[100];
-
-    TokenList *tokens = NULL;
-    TokenList *tokensTail = NULL;
-    Token *token = NULL;
-    chr = fgetc(file);
-    int i = 0;
-    int c = 0;
-    int line = 1;
-    while (1) {
-        if (chr == EOF) {
-            break;
-        } else if (chr == ' ') {
-           // do nothing
-        } else if (isDigit(chr)) {
-            int startOffset = i;
-            int startLine = line;
-            int startChar = c;
-            // get identifier or keyword
-            int j = 0;
-            while (1) {
-                if (j >= BUFFER_LEN) {
-                    errorInfo->offset = i;
-                    errorInfo->line = line;
-                    errorInfo->character = c;
-                    return NumberTooLong;
-                }
-                buffer[j++] = chr;
-                chr = fgetc(file);
-                c++;
-                i++;
-                if (!isDigit(chr)) {
-                    break;
-                }
-            }
-            // new id token
-            char *text = malloc(sizeof(char) * (j + 1));
-            strncpy(text, buffer, j);
-            text[j] = 0;
-            token = createTokenLong(
-                IntLit, text,
-                startOffset, i,
-                startLine, line,
-                startChar, c
-            );
-            tokenListAppend(&tokens, &tokensTail, token);
-            continue;
-        } else if (isAlpha(chr)) {
-            int startOffset = i;
-            int startLine = line;
-            int startChar = c;
-            int j = 0;
-            while (1) {
-                if (j >= BUFFER_LEN) {
-                    errorInfo->offset = i;
-                    errorInfo->line = line;
-                    errorInfo->character = c;
-                    return IdTooLong;
-                }
-                buffer[j++] = chr;
-                chr = fgetc(file);
-                c++;
-                i++;
-                if (!isAlpha(chr)) {
-                    break;
-                }
-            }
-            char *text = malloc(sizeof(char) * (j + 1));
-            strncpy(text, buffer, j);
-            text[j] = 0;
-            token = createTokenLong(
-                Id, text,
-                startOffset, i,
-                startLine, line,
-                startChar, c
-            );
-            tokenListAppend(&tokens, &tokensTail, token);
-            continue;
-        } else if (chr == '"') {
-            int startOffset = i;
-            int startLine = line;
-            int startChar = c;
-            int j = 0;
-            chr = fgetc(file);
-            c++;
-            i++;
-            while (1) {
-                if (j >= BUFFER_LEN) {
-                    errorInfo->offset = i;
-                    errorInfo->line = line;
-                    errorInfo->character = c;
-                    return StrTooLong;
-                }
-                if (chr == '\\') {
-                    chr = fgetc(file);
-                    c++;
-                    i++;
-                    if (chr == '"') {
-                        buffer[j++] = chr;
-                    } else if (chr == 't') {
-                        buffer[j++] = '\t';
-                    } else if (chr == 'n') {
-                        buffer[j++] = '\n';
-                    } else {
-                        buffer[j++] = chr;
-                    }
-                } else if (chr == '"') {
-                    chr = fgetc(file);
-                    c++;
-                    i++;
-                    break;
-                } else {
-                    buffer[j++] = chr;
-                }
-                chr = fgetc(file);
-                c++;
-                i++;
-            }
-            char *text = malloc(sizeof(char) * (j + 1));
-            strncpy(text, buffer, j);
-            text[j] = 0;
-            token = createTokenLong(
-                StrLit, text,
-                startOffset, i,
-                startLine, line,
-                startChar, c
-            );
-            tokenListAppend(&tokens, &tokensTail, token);
-            continue;
-        } else if (chr == '+') {
-            token = createToken(AddOp, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == '-') {
-            token = createToken(SubtractOp, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == '/') {
-            token = createToken(DivideOp, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == '*') {
-            token = createToken(MultiplyOp, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == '(') {
-            token = createToken(LeftParan, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == ')') {
-            token = createToken(RightParan, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == '{') {
-            token = createToken(LeftBrace, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == '}') {
-            token = createToken(RightBrace, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == '[') {
-            token = createToken(LeftBracket, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == ']') {
-            token = createToken(RightBracket, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == '=') {
-            chr = fgetc(file);
-            c++;
-            i++;
-            if (chr == '=') {
-                token = createToken(EqualOp, NULL, i, line, c);
-                tokenListAppend(&tokens, &tokensTail, token);
-            } else {
-                token = createToken(AssignOp, NULL, i, line, c);
-                tokenListAppend(&tokens, &tokensTail, token);
-                continue;
-            }
-        } else if (chr == '<') {
-            chr = fgetc(file);
-            c++;
-            i++;
-            if (chr == '=') {
-                token = createToken(LessThanOrEqual, NULL, i, line, c);
-                tokenListAppend(&tokens, &tokensTail, token);
-            } else {
-                token = createToken(LessThan, NULL, i, line, c);
-                tokenListAppend(&tokens, &tokensTail, token);
-                continue;
+// Decodes the escapes of a string literal body into decoded, which must
+// hold at least len chars. Only called for literals that actually contain a
+// backslash, every other string is used straight from the source.
+int decodeStrLit(char *chars, int len, char *decoded) {
+    int j = 0;
+    for (int k = 0; k < len; k++) {
+        char chr = chars[k];
+        if (chr == '\\' && k + 1 < len) {
+            chr = chars[++k];
+            if (chr == 't') {
+                chr = '\t';
+            } else if (chr == 'n') {
+                chr = '\n';
             }
-        } else if (chr == '>') {
-            chr = fgetc(file);
-            c++;
-            i++;
-            if (chr == '=') {
-                token = createToken(GreaterThanOrEqual, NULL, i, line, c);
-                tokenListAppend(&tokens, &tokensTail, token);
-            } else {
-                token = createToken(GreaterThan, NULL, i, line, c);
-                tokenListAppend(&tokens, &tokensTail, token);
-                continue;
-            }
-        } else if (chr == '.') {
-            token = createToken(Dot, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == ',') {
-            token = createToken(Comma, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
-        } else if (chr == '#') {
-            int startOffset = i;
-            int startLine = line;
-            int startChar = c;
-            int j = 0;
-            chr = fgetc(file);
-            i++;
-            c++;
-            while (1) {
-                if (j >= BUFFER_LEN) {
-                    errorInfo->offset = i;
-                    errorInfo->line = line;
-                    errorInfo->character = c;
-                    return CommentTooLong;
-                }
-                if (chr == '\n') {
-                    chr = fgetc(file);
-                    i++;
-                    c++;
-                    break;
-                } else if (chr == EOF) {
-                    break;
-                } else {
-                    buffer[j++] = chr;
-                }
-                chr = fgetc(file);
-                i++;
-                c++;
-            }
-            char *text = malloc(sizeof(char) * (j + 1));
-            strncpy(text, buffer, j);
-            text[j] = 0;
-            token = createTokenLong(
-                Comment, text,
-                startOffset, i,
-                startLine, line,
-                startChar, c
-            );
-            tokenListAppend(&tokens, &tokensTail, token);
+        }
+        decoded[j++] = chr;
+    }
+    return j;
+}
+
+void initBuffer(Buffer *buffer) {
+    buffer->cap = 4096;
+    buffer->len = 0;
+    buffer->data = malloc(buffer->cap);
+}
+
+void bufferReserve(Buffer *buffer, size_t extra) {
+    if (buffer->len + extra > buffer->cap) {
+        while (buffer->len + extra > buffer->cap) {
+            buffer->cap *= 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->cap);
+    }
+}
+
+void bufferAppend(Buffer *buffer, const char *chars, size_t len) {
+    bufferReserve(buffer, len);
+    memcpy(buffer->data + buffer->len, chars, len);
+    buffer->len += len;
+}
+
+void bufferAppendStr(Buffer *buffer, const char *str) {
+    bufferAppend(buffer, str, strlen(str));
+}
+
+void bufferPrintf(Buffer *buffer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    bufferReserve(buffer, len + 1);
+    va_start(args, format);
+    vsnprintf(buffer->data + buffer->len, len + 1, format, args);
+    va_end(args);
+    buffer->len += len;
+}
+
+// Output of the dumps is gathered in buffer and handed to out a block at
+// a time, rather than with a printf per field
+#define WRITER_BLOCK (64 * 1024)
+
+typedef struct _Writer {
+    FILE *out;
+    Buffer buffer;
+} Writer;
+
+void initWriter(Writer *writer, FILE *out) {
+    writer->out = out;
+    writer->buffer.cap = WRITER_BLOCK;
+    writer->buffer.len = 0;
+    writer->buffer.data = malloc(WRITER_BLOCK);
+}
+
+void writerFlush(Writer *writer) {
+    fwrite(writer->buffer.data, 1, writer->buffer.len, writer->out);
+    writer->buffer.len = 0;
+}
+
+void freeWriter(Writer *writer) {
+    writerFlush(writer);
+    free(writer->buffer.data);
+}
+
+void writeBytes(Writer *writer, const char *chars, size_t len) {
+    Buffer *buffer = &writer->buffer;
+    if (buffer->len + len > buffer->cap) {
+        writerFlush(writer);
+        if (len > buffer->cap) {
+            fwrite(chars, 1, len, writer->out);
+            return;
+        }
+    }
+    memcpy(buffer->data + buffer->len, chars, len);
+    buffer->len += len;
+}
+
+static inline void writeChar(Writer *writer, char chr) {
+    if (writer->buffer.len == writer->buffer.cap) {
+        writerFlush(writer);
+    }
+    writer->buffer.data[writer->buffer.len++] = chr;
+}
+
+void writeStr(Writer *writer, const char *str) {
+    writeBytes(writer, str, strlen(str));
+}
+
+void writeInt(Writer *writer, int64_t value) {
+    char digits[24];
+    int pos = sizeof (digits);
+    uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    do {
+        digits[--pos] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) {
+        digits[--pos] = '-';
+    }
+    writeBytes(writer, digits + pos, sizeof (digits) - pos);
+}
+
+// Two spaces per level
+void writeIndent(Writer *writer, int level) {
+    static const char spaces[] = "                                                                ";
+    size_t len = (size_t)level * 2;
+    while (len > 0) {
+        size_t n = len < sizeof (spaces) - 1 ? len : sizeof (spaces) - 1;
+        writeBytes(writer, spaces, n);
+        len -= n;
+    }
+}
+
+// Writes chars as a JSON string, which the S-expressions use as well. Runs
+// of characters that need no escape are copied in one go.
+void writeQuoted(Writer *writer, const char *chars, int len) {
+    writeChar(writer, '"');
+    int run = 0;
+    for (int i = 0; i < len; i++) {
+        unsigned char chr = chars[i];
+        if (chr >= ' ' && chr != '"' && chr != '\\') {
             continue;
+        }
+        writeBytes(writer, chars + run, i - run);
+        run = i + 1;
+        if (chr == '"' || chr == '\\') {
+            writeChar(writer, '\\');
+            writeChar(writer, chr);
         } else if (chr == '\n') {
-            token = createToken(Newline, NULL, i, line, c);
-            tokenListAppend(&tokens, &tokensTail, token);
+            writeBytes(writer, "\\n", 2);
+        } else if (chr == '\t') {
+            writeBytes(writer, "\\t", 2);
+        } else {
+            char escape[8];
+            snprintf(escape, sizeof (escape), "\\u%04x", chr);
+            writeBytes(writer, escape, 6);
+        }
+    }
+    writeBytes(writer, chars + run, len - run);
+    writeChar(writer, '"');
+}
+
+// Line (from 1) holding offset, by binary search over the line starts
+int lineOfOffset(TokenArray *tokens, int64_t offset) {
+    int low = 0;
+    int high = tokens->lineCount;
+    while (high - low > 1) {
+        int mid = low + (high - low) / 2;
+        if (tokens->lineStarts[mid] <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low + 1;
+}
+
+// Column (from 1) of offset on its line
+int columnOfOffset(TokenArray *tokens, int64_t offset, int line) {
+    return offset - tokens->lineStarts[line - 1] + 1;
+}
+
+// lineOfOffset starting from the line in *hint, so that lookups made in
+// increasing offset order, as the compiler makes them, take a step or two
+int lineOfOffsetNear(TokenArray *tokens, int64_t offset, int *hint) {
+    int line = *hint;
+    if (tokens->lineStarts[line - 1] > offset) {
+        line = lineOfOffset(tokens, offset);
+    } else {
+        for (int steps = 0; line < tokens->lineCount && tokens->lineStarts[line] <= offset; steps++) {
+            if (steps == 8) {
+                line = lineOfOffset(tokens, offset);
+                break;
+            }
             line++;
-            c = 0;
+        }
+    }
+    *hint = line;
+    return line;
+}
+
+int tokenLine(TokenArray *tokens, int index) {
+    return lineOfOffset(tokens, tokens->offsets[index]);
+}
+
+int tokenChar(TokenArray *tokens, int index) {
+    int64_t offset = tokens->offsets[index];
+    return columnOfOffset(tokens, offset, lineOfOffset(tokens, offset));
+}
+
+static const char *tokenTypeNames[EndOfInput + 1] = {
+    [IntLit] = "IntLit",
+    [StrLit] = "StrLit",
+    [Id] = "ID",
+    [AssignOp] = "AssignOp",
+    [AddOp] = "AddOp",
+    [SubtractOp] = "SubtractOp",
+    [DivideOp] = "DivideOp",
+    [MultiplyOp] = "MultiplyOp",
+    [LeftParan] = "LeftParan",
+    [RightParan] = "RightParan",
+    [LeftBrace] = "LeftBrace",
+    [RightBrace] = "RightBrace",
+    [LeftBracket] = "LeftBracket",
+    [RightBracket] = "RightBracket",
+    [EqualOp] = "EqualOp",
+    [LessThan] = "LessThan",
+    [LessThanOrEqual] = "LessThanOrEqual",
+    [GreaterThan] = "GreaterThan",
+    [GreaterThanOrEqual] = "GreaterThanOrEqual",
+    [Dot] = "Dot",
+    [Newline] = "Newline",
+    [Comma] = "Comma",
+    [Comment] = "Comment",
+    [IfKeyword] = "IfKeyword",
+    [LoopKeyword] = "LoopKeyword",
+    [BreakKeyword] = "BreakKeyword",
+    [EndOfInput] = "EndOfInput",
+};
+
+// Writes one token: Token(type,value) on a line of its own as text,
+// {"type","value","start","end"} as JSON and (type value start end) as an
+// S-expression. Only IntLit, ID, StrLit and Comment tokens have a value.
+void writeToken(Writer *writer, Interner *interner, TokenArray *tokens, int index, DumpFormat format) {
+    TokenType type = tokens->types[index];
+    int hasText = type == Id || type == StrLit || type == Comment;
+    Slice text;
+    if (hasText) {
+        text = symbolName(interner, tokens->values[index]);
+    }
+    if (format == DumpText) {
+        writeStr(writer, "Token(");
+        writeStr(writer, tokenTypeNames[type]);
+        if (type == IntLit) {
+            writeChar(writer, ',');
+            writeInt(writer, (int)tokens->values[index]);
+        } else if (hasText) {
+            // Comments have always been printed without the comma
+            if (type != Comment) {
+                writeChar(writer, ',');
+            }
+            writeBytes(writer, text.chars, text.len);
+        }
+        writeStr(writer, ")\n");
+        return;
+    }
+    int json = format == DumpJson;
+    writeStr(writer, json ? "{\"type\":\"" : "(");
+    writeStr(writer, tokenTypeNames[type]);
+    writeStr(writer, json ? "\"," : " ");
+    if (type == IntLit || hasText) {
+        if (json) {
+            writeStr(writer, "\"value\":");
+        }
+        if (type == IntLit) {
+            writeInt(writer, (int)tokens->values[index]);
         } else {
-            errorInfo->offset = i;
-            errorInfo->line = line;
-            errorInfo->character = c;
-            return UnknownChar;
+            writeQuoted(writer, text.chars, text.len);
         }
+        writeChar(writer, json ? ',' : ' ');
+    }
+    if (json) {
+        writeStr(writer, "\"start\":");
+    }
+    writeInt(writer, tokens->offsets[index]);
+    writeStr(writer, json ? ",\"end\":" : " ");
+    writeInt(writer, tokens->offsets[index] + tokens->lengths[index]);
+    writeChar(writer, json ? '}' : ')');
+}
+
+// The text form of one token, as it appears in error messages
+void printToken(FILE *out, Interner *interner, TokenArray *tokens, int index) {
+    Writer writer;
+    initWriter(&writer, out);
+    writeToken(&writer, interner, tokens, index, DumpText);
+    freeWriter(&writer);
+}
 
-        chr = fgetc(file);
-        c++;
-        i++;
+// Writes every token: a line each as text, otherwise one JSON array or
+// one list
+void dumpTokens(FILE *out, Interner *interner, TokenArray *tokens, DumpFormat format) {
+    Writer writer;
+    initWriter(&writer, out);
+    if (format != DumpText) {
+        writeChar(&writer, format == DumpJson ? '[' : '(');
     }
+    for (int i = 0; i < tokens->count; i++) {
+        if (i > 0 && format != DumpText) {
+            writeChar(&writer, format == DumpJson ? ',' : ' ');
+        }
+        writeToken(&writer, interner, tokens, i, format);
+    }
+    if (format != DumpText) {
+        writeStr(&writer, format == DumpJson ? "]\n" : ")\n");
+    }
+    freeWriter(&writer);
+}
 
-    (*tokensRetval) = tokens;
+void initTokenArray(TokenArray *tokens, int capacity) {
+    tokens->count = 0;
+    tokens->capacity = capacity;
+    tokens->allocations = 5;
+    tokens->types = malloc(sizeof (TokenType) * capacity);
+    tokens->values = malloc(sizeof (uint32_t) * capacity);
+    tokens->offsets = malloc(sizeof (int64_t) * capacity);
+    tokens->lengths = malloc(sizeof (int) * capacity);
+    tokens->lineCapacity = 64;
+    tokens->lineStarts = malloc(sizeof (int64_t) * tokens->lineCapacity);
+    tokens->lineStarts[0] = 0;
+    tokens->lineCount = 1;
+}
 
-    return 0;
+void freeTokenArray(TokenArray *tokens) {
+    free(tokens->types);
+    free(tokens->values);
+    free(tokens->offsets);
+    free(tokens->lengths);
+    free(tokens->lineStarts);
 }
 
-void copyLocation(Location *src, Location *dest) {
-    memcpy(src, dest, sizeof (Location));
+void tokenArrayAddLine(TokenArray *tokens, int64_t start) {
+    if (tokens->lineCount == tokens->lineCapacity) {
+        tokens->lineCapacity *= 2;
+        tokens->lineStarts = realloc(
+            tokens->lineStarts, sizeof (int64_t) * tokens->lineCapacity
+        );
+        tokens->allocations++;
+    }
+    tokens->lineStarts[tokens->lineCount++] = start;
 }
 
-void copyLocationStart(Location *src, Location *dest) {
-    src->startOffset = dest->startOffset;
-    src->startLine = dest->startLine;
-    src->startChar = dest->startChar;
+void tokenArrayAppend(
+    TokenArray *tokens,
+    TokenType type,
+    uint32_t value,
+    int64_t offset,
+    int length
+) {
+    // Always keep a free slot for the EndOfInput terminator
+    if (tokens->count + 1 >= tokens->capacity) {
+        int capacity = tokens->capacity * 2;
+        tokens->types = realloc(tokens->types, sizeof (TokenType) * capacity);
+        tokens->values = realloc(tokens->values, sizeof (uint32_t) * capacity);
+        tokens->offsets = realloc(tokens->offsets, sizeof (int64_t) * capacity);
+        tokens->lengths = realloc(tokens->lengths, sizeof (int) * capacity);
+        tokens->capacity = capacity;
+        tokens->allocations += 4;
+    }
+    int i = tokens->count++;
+    tokens->types[i] = type;
+    tokens->values[i] = value;
+    tokens->offsets[i] = offset;
+    tokens->lengths[i] = length;
 }
 
-void copyLocationEnd(Location *src, Location *dest) {
-    src->endOffset = dest->endOffset;
-    src->endLine = dest->endLine;
-    src->endChar = dest->endChar;
+void setLexError(TokenizeErrorInfo *errorInfo, TokenArray *tokens, int64_t offset) {
+    errorInfo->offset = offset;
+    errorInfo->line = lineOfOffset(tokens, offset);
+    errorInfo->character = columnOfOffset(tokens, offset, errorInfo->line);
 }
 
-int printAST(Node *node, int level) {
-    for (int i = 0; i < level; i++) {
-        printf("  ");
+// Opens filename for tokenizing. Regular files are mapped read-only in
+// one piece; anything else (stdin as "-", pipes, devices) is left open as
+// source->fd to be read in chunks by tokenizeStream.
+int openSource(char *filename, Source *source) {
+    source->data = NULL;
+    source->len = 0;
+    source->fd = -1;
+    int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd == -1) {
+        return -1;
     }
-    switch (node->type) {
-        case VarAssign:
-            {
-                printf("VarAssign\n");
-                struct VarAssignData *data = &(node->data.varAssign);
-                printAST(data->varType, level + 1);
-                printAST(data->varName, level + 1);
-                printAST(data->initValue, level + 1);
-                break;
-            }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        source->fd = fd;
+        return 0;
+    }
+    source->len = st.st_size;
+    if (source->len > 0) {
+        source->data = mmap(NULL, source->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (source->data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+void closeSource(Source *source) {
+    if (source->data != NULL) {
+        munmap(source->data, source->len);
+    }
+    if (source->fd > STDIN_FILENO) {
+        close(source->fd);
+    }
+}
+
+int sliceToInt(char *chars, int len) {
+    // Wraps around on overflow rather than being undefined
+    unsigned int val = 0;
+    for (int i = 0; i < len; i++) {
+        val = val * 10 + (chars[i] - '0');
+    }
+    return val;
+}
+
+// Interns the body of a string literal, decoding escapes into the lexer's
+// scratch buffer first only when the body contains a backslash.
+Symbol internStrLit(Lexer *lexer, char *body, int len) {
+    if (memchr(body, '\\', len) == NULL) {
+        return intern(lexer->interner, body, len);
+    }
+    lexer->scratch.len = 0;
+    bufferReserve(&lexer->scratch, len);
+    int decodedLen = decodeStrLit(body, len, lexer->scratch.data);
+    return intern(lexer->interner, lexer->scratch.data, decodedLen);
+}
+
+void initLexer(Lexer *lexer, Interner *interner, TokenArray *tokens) {
+    lexer->interner = interner;
+    lexer->tokens = tokens;
+    lexer->baseOffset = 0;
+    initBuffer(&lexer->scratch);
+    initTokenArray(tokens, 256);
+}
+
+// Lexes the tokens in chunk, which starts at lexer->baseOffset in the
+// source. Unless final is set, a token that runs into the end of the chunk
+// may continue in the next one, so lexing stops in front of it and
+// *consumed tells the caller where to resume.
+TokenizeErrorType lexChunk(
+    Lexer *lexer,
+    char *chunk,
+    size_t len,
+    int final,
+    size_t *consumed,
+    TokenizeErrorInfo *errorInfo
+) {
+    TokenArray *tokens = lexer->tokens;
+    int64_t baseOffset = lexer->baseOffset;
+    char *end = chunk + len;
+    char *p = chunk;
+    char *start = p;
+    TokenizeErrorType result = LexSuccess;
+    while (p < end) {
+        char chr = *p;
+        start = p;
+        int64_t offset = baseOffset + (p - chunk);
+        TokenType type;
+        uint32_t value = 0;
+        switch (charClasses[(unsigned char)chr]) {
+            case CharSpace:
+                p = scanSpaces(p + 1, end);
+                continue;
+            case CharNewline:
+                type = Newline;
+                p++;
+                tokenArrayAddLine(tokens, offset + 1);
+                break;
+            case CharDigit:
+                p = scanDigits(p + 1, end);
+                if (p == end && !final) {
+                    goto partial;
+                }
+                type = IntLit;
+                value = sliceToInt(start, p - start);
+                break;
+            case CharAlpha:
+                p = scanAlpha(p + 1, end);
+                if (p == end && !final) {
+                    goto partial;
+                }
+                type = keywordType(start, p - start);
+                if (type == Id) {
+                    value = intern(lexer->interner, start, p - start);
+                }
+                break;
+            case CharQuote:
+                {
+                    p++;
+                    // Lines started inside a string cut off by the chunk
+                    // are dropped and recorded again with the next chunk
+                    int lineCount = tokens->lineCount;
+                    while (1) {
+                        p = scanStrBody(p, end);
+                        if (p >= end || *p == '"') {
+                            break;
+                        } else if (*p == '\\') {
+                            if (p + 1 < end && p[1] == '\n') {
+                                tokenArrayAddLine(tokens, baseOffset + (p + 2 - chunk));
+                            }
+                            p += 2;
+                        } else {
+                            p++;
+                            tokenArrayAddLine(tokens, baseOffset + (p - chunk));
+                        }
+                    }
+                    if (p >= end) {
+                        if (!final) {
+                            tokens->lineCount = lineCount;
+                            goto partial;
+                        }
+                        setLexError(errorInfo, tokens, offset);
+                        result = UnterminatedStr;
+                        goto done;
+                    }
+                    p++;
+                    type = StrLit;
+                    value = internStrLit(lexer, start + 1, p - start - 2);
+                    break;
+                }
+            case CharHash:
+                p = scanToNewline(p + 1, end);
+                if (p == end && !final) {
+                    goto partial;
+                }
+                type = Comment;
+                value = intern(lexer->interner, start + 1, p - start - 1);
+                break;
+            case CharCompare:
+                {
+                    if (p + 1 == end && !final) {
+                        goto partial;
+                    }
+                    p++;
+                    int orEqual = p < end && *p == '=';
+                    if (orEqual) {
+                        p++;
+                    }
+                    if (chr == '=') {
+                        type = orEqual ? EqualOp : AssignOp;
+                    } else if (chr == '<') {
+                        type = orEqual ? LessThanOrEqual : LessThan;
+                    } else {
+                        type = orEqual ? GreaterThanOrEqual : GreaterThan;
+                    }
+                    break;
+                }
+            case CharSingle:
+                type = singleCharTokens[(unsigned char)chr];
+                p++;
+                break;
+            default:
+                setLexError(errorInfo, tokens, offset);
+                result = UnknownChar;
+                goto done;
+        }
+        tokenArrayAppend(tokens, type, value, offset, p - start);
+    }
+    start = p;
+partial:
+    *consumed = start - chunk;
+    lexer->baseOffset = baseOffset + (start - chunk);
+done:
+    return result;
+}
+
+void finishLexer(Lexer *lexer, TokenizeErrorType result) {
+    free(lexer->scratch.data);
+    if (result == LexSuccess) {
+        lexer->tokens->types[lexer->tokens->count] = EndOfInput;
+    } else {
+        freeTokenArray(lexer->tokens);
+    }
+}
+
+int tokenize(
+    Source *source,
+    Interner *interner,
+    TokenArray *tokens,
+    TokenizeErrorInfo *errorInfo
+) {
+    Lexer lexer;
+    size_t consumed;
+    initLexer(&lexer, interner, tokens);
+    TokenizeErrorType result = lexChunk(
+        &lexer, source->data, source->len, 1, &consumed, errorInfo
+    );
+    finishLexer(&lexer, result);
+    return result;
+}
+
+#define STREAM_CHUNK_SIZE (1024 * 1024)
+
+// Tokenizes whatever can be read from fd in fixed-size chunks, so the
+// source never has to be held in memory as a whole. The unconsumed tail of
+// one chunk (a token cut off by the chunk boundary) is moved to the front of
+// the buffer and the next chunk is read in behind it; the buffer only grows
+// if a single token is longer than it.
+int tokenizeStream(
+    int fd,
+    Interner *interner,
+    TokenArray *tokens,
+    TokenizeErrorInfo *errorInfo,
+    int64_t *bytesRead
+) {
+    Lexer lexer;
+    initLexer(&lexer, interner, tokens);
+    size_t capacity = 2 * STREAM_CHUNK_SIZE;
+    char *buffer = malloc(capacity);
+    size_t carried = 0;
+    int final = 0;
+    TokenizeErrorType result = LexSuccess;
+    *bytesRead = 0;
+    while (!final) {
+        size_t len = carried;
+        // Fill up to one chunk past the carried tail before lexing
+        while (len < carried + STREAM_CHUNK_SIZE && len < capacity) {
+            ssize_t n = read(fd, buffer + len, capacity - len);
+            if (n < 0) {
+                errorInfo->offset = lexer.baseOffset + len;
+                errorInfo->line = tokens->lineCount;
+                errorInfo->character = 0;
+                result = ReadFailed;
+                break;
+            } else if (n == 0) {
+                final = 1;
+                break;
+            }
+            len += n;
+            *bytesRead += n;
+        }
+        if (result != LexSuccess) {
+            break;
+        }
+        size_t consumed;
+        result = lexChunk(&lexer, buffer, len, final, &consumed, errorInfo);
+        if (result != LexSuccess) {
+            break;
+        }
+        carried = len - consumed;
+        memmove(buffer, buffer + consumed, carried);
+        if (carried + STREAM_CHUNK_SIZE > capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+    }
+    free(buffer);
+    finishLexer(&lexer, result);
+    return result;
+}
+
+// Tokenizes an opened source, from the mapping when there is one and by
+// streaming its fd otherwise
+int tokenizeSource(
+    Source *source,
+    Interner *interner,
+    TokenArray *tokens,
+    TokenizeErrorInfo *errorInfo
+) {
+    if (source->fd < 0) {
+        return tokenize(source, interner, tokens, errorInfo);
+    }
+    int64_t bytesRead;
+    int result = tokenizeStream(source->fd, interner, tokens, errorInfo, &bytesRead);
+    source->len = bytesRead;
+    return result;
+}
+
+void initAst(Ast *ast) {
+    ast->capacity = 256;
+    ast->count = 0;
+    ast->nodes = malloc(sizeof (Node) * ast->capacity);
+    ast->extraCapacity = 256;
+    ast->extraCount = 0;
+    ast->extra = malloc(sizeof (NodeIndex) * ast->extraCapacity);
+    ast->scratchCapacity = 64;
+    ast->scratchCount = 0;
+    ast->scratch = malloc(sizeof (NodeIndex) * ast->scratchCapacity);
+    ast->allocations = 3;
+}
+
+void freeAst(Ast *ast) {
+    free(ast->nodes);
+    free(ast->extra);
+    free(ast->scratch);
+}
+
+void resetAst(Ast *ast) {
+    ast->count = 0;
+    ast->extraCount = 0;
+    ast->scratchCount = 0;
+}
+
+size_t astBytes(Ast *ast) {
+    return (size_t)ast->capacity * sizeof (Node) +
+        (size_t)(ast->extraCapacity + ast->scratchCapacity) * sizeof (NodeIndex);
+}
+
+void reserveNodes(Ast *ast, int count) {
+    if (ast->count + count > ast->capacity) {
+        while (ast->count + count > ast->capacity) {
+            ast->capacity *= 2;
+        }
+        ast->nodes = realloc(ast->nodes, sizeof (Node) * ast->capacity);
+        ast->allocations++;
+    }
+}
+
+// Appends count words to extra and returns the index of the first
+uint32_t addExtra(Ast *ast, int count) {
+    if (ast->extraCount + count > ast->extraCapacity) {
+        while (ast->extraCount + count > ast->extraCapacity) {
+            ast->extraCapacity *= 2;
+        }
+        ast->extra = realloc(ast->extra, sizeof (NodeIndex) * ast->extraCapacity);
+        ast->allocations++;
+    }
+    uint32_t start = ast->extraCount;
+    ast->extraCount += count;
+    return start;
+}
+
+// Appends a node covering source bytes [start, end). Node pointers taken
+// before this may be left dangling, since the array can move.
+NodeIndex addNode(Ast *ast, NodeType type, int64_t start, int64_t end) {
+    reserveNodes(ast, 1);
+    Node *node = &ast->nodes[ast->count];
+    // Clearing the padding too keeps the bytes written to the AST cache
+    // the same from one run to the next
+    memset(node, 0, sizeof (Node));
+    node->type = type;
+    node->length = end - start;
+    node->start = start;
+    return ast->count++;
+}
+
+int64_t nodeEnd(Node *node) {
+    return node->start + node->length;
+}
+
+void pushScratch(Ast *ast, NodeIndex index) {
+    if (ast->scratchCount == ast->scratchCapacity) {
+        ast->scratchCapacity *= 2;
+        ast->scratch = realloc(ast->scratch, sizeof (NodeIndex) * ast->scratchCapacity);
+        ast->allocations++;
+    }
+    ast->scratch[ast->scratchCount++] = index;
+}
+
+// Gives node the items pushed onto scratch since it held base items, as
+// its children, and pops them
+void setChildrenFromScratch(Ast *ast, NodeIndex index, int base) {
+    int count = ast->scratchCount - base;
+    uint32_t start = addExtra(ast, count);
+    memcpy(ast->extra + start, ast->scratch + base, sizeof (NodeIndex) * count);
+    ast->nodes[index].data.children.start = start;
+    ast->nodes[index].data.children.count = count;
+    ast->scratchCount = base;
+}
+
+int hasChildren(NodeType type) {
+    return type == VarAssign || type == FunCall || type == Program ||
+        type == IfStatement || type == LoopStatement;
+}
+
+Node *nodeAt(Ast *ast, NodeIndex index) {
+    return &ast->nodes[index];
+}
+
+Node *childAt(Ast *ast, Node *node, int i) {
+    return &ast->nodes[ast->extra[node->data.children.start + i]];
+}
+
+// Children of any node, counting the lhs and rhs of a BinaryOp as two
+uint32_t childCount(Node *node) {
+    if (node->type == BinaryOp) {
+        return 2;
+    }
+    return hasChildren(node->type) ? node->data.children.count : 0;
+}
+
+NodeIndex childIndex(Ast *ast, Node *node, uint32_t i) {
+    if (node->type == BinaryOp) {
+        return i == 0 ? node->data.binOp.lhs : node->data.binOp.rhs;
+    }
+    return ast->extra[node->data.children.start + i];
+}
+
+// A node a walker is inside and the next of its children to visit, with
+// what the walker needs back when it leaves the node: how long one of its
+// lists was on the way in, and a code position, label or register.
+typedef struct _WalkFrame {
+    NodeIndex node;
+    uint32_t next;
+    int base;
+    int mark;
+} WalkFrame;
+
+// Walkers keep the nodes they are inside here on the heap rather than on
+// the C stack, so how deeply a program nests is limited only by memory
+typedef struct _WalkStack {
+    WalkFrame *frames;
+    int count;
+    int capacity;
+} WalkStack;
+
+void initWalkStack(WalkStack *stack) {
+    stack->capacity = 64;
+    stack->count = 0;
+    stack->frames = malloc(sizeof (WalkFrame) * stack->capacity);
+}
+
+void freeWalkStack(WalkStack *stack) {
+    free(stack->frames);
+}
+
+// Pushes node to be visited from its child next on. Frames move when the
+// stack grows, so the one returned is only good until the next push.
+WalkFrame *pushWalk(WalkStack *stack, NodeIndex node, uint32_t next) {
+    if (stack->count == stack->capacity) {
+        stack->capacity *= 2;
+        stack->frames = realloc(stack->frames, sizeof (WalkFrame) * stack->capacity);
+    }
+    WalkFrame *frame = &stack->frames[stack->count++];
+    frame->node = node;
+    frame->next = next;
+    frame->base = 0;
+    frame->mark = 0;
+    return frame;
+}
+
+WalkFrame *topWalk(WalkStack *stack) {
+    return &stack->frames[stack->count - 1];
+}
+
+// Moves the nodes of other to the end of ast and renumbers the indices
+// they hold. Every word in extra is a node index, so extra is renumbered
+// in one pass. Returns the index the first node of other ended up at.
+NodeIndex appendAst(Ast *ast, Ast *other) {
+    reserveNodes(ast, other->count);
+    NodeIndex nodeBase = ast->count;
+    uint32_t extraBase = addExtra(ast, other->extraCount);
+    memcpy(ast->nodes + nodeBase, other->nodes, sizeof (Node) * other->count);
+    ast->count += other->count;
+    for (int i = 0; i < other->extraCount; i++) {
+        ast->extra[extraBase + i] = other->extra[i] + nodeBase;
+    }
+    for (int i = nodeBase; i < ast->count; i++) {
+        Node *node = &ast->nodes[i];
+        if (node->type == BinaryOp) {
+            node->data.binOp.lhs += nodeBase;
+            node->data.binOp.rhs += nodeBase;
+        } else if (hasChildren(node->type)) {
+            node->data.children.start += extraBase;
+        }
+    }
+    return nodeBase;
+}
+
+static const char *nodeTypeNames[BreakStatement + 1] = {
+    [VarAssign] = "VarAssign",
+    [FunCall] = "FunCall",
+    [IntLiteral] = "IntLiteral",
+    [StrLiteral] = "StrLiteral",
+    [Identifier] = "Identifier",
+    [TypeIdentifier] = "TypeIdentifier",
+    [Program] = "Program",
+    [BinaryOp] = "BinaryOp",
+    [IfStatement] = "IfStatement",
+    [LoopStatement] = "LoopStatement",
+    [BreakStatement] = "BreakStatement",
+};
+
+// Writes what a node says before its children, and the whole node when it
+// has none. As text that is its line; as JSON the object up to its
+// children array, {"type","start","end"} plus "value", "name" or "op"; as
+// an S-expression the list up to its children, (type value).
+void writeNodeHead(Writer *writer, Interner *interner, Node *node, int level, DumpFormat format) {
+    int hasValue = node->type == IntLiteral || node->type == StrLiteral ||
+        node->type == Identifier || node->type == TypeIdentifier || node->type == BinaryOp;
+    int isParent = node->type == BinaryOp || hasChildren(node->type);
+    if (format == DumpText) {
+        writeIndent(writer, level);
+        writeStr(writer, nodeTypeNames[node->type]);
+    } else if (format == DumpJson) {
+        writeStr(writer, "{\"type\":\"");
+        writeStr(writer, nodeTypeNames[node->type]);
+        writeStr(writer, "\",\"start\":");
+        writeInt(writer, node->start);
+        writeStr(writer, ",\"end\":");
+        writeInt(writer, nodeEnd(node));
+        if (hasValue) {
+            writeStr(writer, node->type == BinaryOp ? ",\"op\":" :
+                node->type == Identifier || node->type == TypeIdentifier ? ",\"name\":" :
+                ",\"value\":");
+        }
+    } else {
+        writeChar(writer, '(');
+        writeStr(writer, nodeTypeNames[node->type]);
+        if (hasValue) {
+            writeChar(writer, ' ');
+        }
+    }
+    if (hasValue) {
+        if (format == DumpText) {
+            writeChar(writer, '(');
+        }
+        if (node->type == IntLiteral) {
+            writeInt(writer, node->data.val);
+        } else if (node->type == BinaryOp) {
+            const char *text = binaryOps[node->op].text != NULL ? binaryOps[node->op].text : "?";
+            if (format == DumpJson) {
+                writeQuoted(writer, text, strlen(text));
+            } else {
+                writeStr(writer, text);
+            }
+        } else {
+            Slice text = symbolName(interner, node->data.name.id);
+            if (format == DumpText || (format == DumpSexp && node->type != StrLiteral)) {
+                writeBytes(writer, text.chars, text.len);
+            } else {
+                writeQuoted(writer, text.chars, text.len);
+            }
+        }
+        if (format == DumpText) {
+            writeChar(writer, ')');
+        }
+    }
+    if (format == DumpText) {
+        writeChar(writer, '\n');
+    } else if (format == DumpJson) {
+        writeStr(writer, isParent ? ",\"children\":[" : "}");
+    } else if (!isParent) {
+        writeChar(writer, ')');
+    }
+}
+
+typedef enum _DumpStep {
+    DumpNode,
+    DumpArgs,
+    DumpClose,
+} DumpStep;
+
+// A step still to be taken by dumpAst. separator is written before the
+// node, if it is not 0.
+typedef struct _DumpItem {
+    NodeIndex index;
+    int level;
+    uint8_t step;
+    char separator;
+} DumpItem;
+
+// Writes the tree under index. The walk keeps its own stack of steps
+// instead of recursing, children being pushed in reverse so that they come
+// off in order, each followed by the step that closes its parent. As text
+// the children of statement lists are indented two levels and the
+// arguments of a call sit under an Args: line, as they always have.
+void dumpAst(FILE *out, Interner *interner, Ast *ast, NodeIndex index, DumpFormat format) {
+    Writer writer;
+    initWriter(&writer, out);
+    int capacity = 64;
+    int count = 0;
+    DumpItem *stack = malloc(sizeof (DumpItem) * capacity);
+    stack[count++] = (DumpItem){ index, 0, DumpNode, 0 };
+    while (count > 0) {
+        DumpItem item = stack[--count];
+        if (item.step == DumpArgs) {
+            writeIndent(&writer, item.level);
+            writeStr(&writer, "Args:\n");
+            continue;
+        } else if (item.step == DumpClose) {
+            writeStr(&writer, format == DumpJson ? "]}" : ")");
+            continue;
+        }
+        if (item.separator != 0) {
+            writeChar(&writer, item.separator);
+        }
+        Node *node = nodeAt(ast, item.index);
+        writeNodeHead(&writer, interner, node, item.level, format);
+        int childCount = 0;
+        if (node->type == BinaryOp) {
+            childCount = 2;
+        } else if (hasChildren(node->type)) {
+            childCount = node->data.children.count;
+        }
+        if (childCount == 0 && !hasChildren(node->type)) {
+            continue;
+        }
+        // The children, the Args: line and the close of this node
+        if (count + childCount + 2 > capacity) {
+            while (count + childCount + 2 > capacity) {
+                capacity *= 2;
+            }
+            stack = realloc(stack, sizeof (DumpItem) * capacity);
+        }
+        if (format != DumpText) {
+            stack[count++] = (DumpItem){ 0, 0, DumpClose, 0 };
+        }
+        int childLevel = item.level +
+            (node->type == Program || node->type == IfStatement || node->type == LoopStatement ? 2 : 1);
+        for (int i = childCount - 1; i >= 0; i--) {
+            NodeIndex child = node->type == BinaryOp
+                ? (i == 0 ? node->data.binOp.lhs : node->data.binOp.rhs)
+                : ast->extra[node->data.children.start + i];
+            int level = node->type == FunCall && i > 0 ? item.level + 2 : childLevel;
+            if (node->type == FunCall && i == 0 && format == DumpText) {
+                stack[count++] = (DumpItem){ 0, item.level + 1, DumpArgs, 0 };
+            }
+            char separator = format == DumpSexp ? ' ' : format == DumpJson && i > 0 ? ',' : 0;
+            stack[count++] = (DumpItem){ child, level, DumpNode, separator };
+        }
+    }
+    if (format != DumpText) {
+        writeChar(&writer, '\n');
+    }
+    free(stack);
+    freeWriter(&writer);
+}
+
+// Adds up the nodes of each NodeType in the tree under index
+void countNodes(Ast *ast, NodeIndex index, int *counts) {
+    WalkStack stack;
+    initWalkStack(&stack);
+    pushWalk(&stack, index, 0);
+    while (stack.count > 0) {
+        Node *node = nodeAt(ast, stack.frames[--stack.count].node);
+        counts[node->type]++;
+        for (uint32_t i = childCount(node); i > 0; i--) {
+            pushWalk(&stack, childIndex(ast, node, i - 1), 0);
+        }
+    }
+    freeWalkStack(&stack);
+}
+
+ParseError parseFunCall(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft);
+ParseError parseUnaryOp(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft);
+ParseError parseBinaryOp(Parser *parser, int pos, int minPrec, NodeIndex *resultNode, int *posLeft);
+ParseError parseBreakStatement(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft);
+
+TokenType tokenTypeAt(Parser *parser, int pos) {
+    return parser->tokens->types[pos];
+}
+
+// Newlines and comments between statements carry no meaning
+int isBlankToken(TokenType type) {
+    return type == Newline || type == Comment;
+}
+
+int64_t tokenEnd(Parser *parser, int pos) {
+    return parser->tokens->offsets[pos] + parser->tokens->lengths[pos];
+}
+
+// A node for the single token at pos, holding the token's value: the
+// symbol of a name or string, or the int of a number
+NodeIndex createTokenNode(Parser *parser, NodeType type, int pos) {
+    NodeIndex index = addNode(parser->ast, type, parser->tokens->offsets[pos], tokenEnd(parser, pos));
+    parser->ast->nodes[index].data.name.id = parser->tokens->values[pos];
+    return index;
+}
+
+ParseError parseExpr(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft) {
+    return parseBinaryOp(parser, pos, 1, resultNode, posLeft);
+}
+
+ParseError parseIntLiteral(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft) {
+    *resultNode = createTokenNode(parser, IntLiteral, pos);
+    *posLeft = pos + 1;
+    return ParseSuccess;
+}
+
+ParseError parseStrLiteral(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft) {
+    *resultNode = createTokenNode(parser, StrLiteral, pos);
+    *posLeft = pos + 1;
+    return ParseSuccess;
+}
+
+// An identifier followed by ( is a call, anything else is a variable
+ParseError parseIdExpr(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft) {
+    if (tokenTypeAt(parser, pos + 1) == LeftParan) {
+        return parseFunCall(parser, pos, resultNode, posLeft);
+    }
+    *resultNode = createTokenNode(parser, Identifier, pos);
+    *posLeft = pos + 1;
+    return ParseSuccess;
+}
+
+typedef ParseError (*NodeParser)(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft);
+
+// Primary expressions are told apart by their first token
+static const NodeParser primaryParsers[EndOfInput + 1] = {
+    [IntLit] = parseIntLiteral,
+    [StrLit] = parseStrLiteral,
+    [Id] = parseIdExpr,
+};
+
+ParseError parseUnaryOp(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft) {
+    NodeParser primaryParser = primaryParsers[tokenTypeAt(parser, pos)];
+    if (primaryParser == NULL) {
+        *posLeft = pos;
+        return ParseNoMatch;
+    }
+    return primaryParser(parser, pos, resultNode, posLeft);
+}
+
+// Precedence climbing: operators of the same level are folded into lhs by
+// the loop, so recursion only happens on a step up in precedence and stays
+// bounded by the number of levels however long the expression is.
+ParseError parseBinaryOp(Parser *parser, int pos, int minPrec, NodeIndex *resultNode, int *posLeft) {
+    NodeIndex lhs;
+    if (ParseSuccess != parseUnaryOp(parser, pos, &lhs, posLeft)) {
+        return ParseNoMatch;
+    }
+    pos = *posLeft;
+    while (1) {
+        TokenType op = tokenTypeAt(parser, pos);
+        const BinaryOpInfo *info = &binaryOps[op];
+        if (info->prec == 0 || info->prec < minPrec) {
+            break;
+        }
+        pos++;
+        NodeIndex rhs;
+        int rhsMinPrec = info->rightAssoc ? info->prec : info->prec + 1;
+        if (ParseSuccess != parseBinaryOp(parser, pos, rhsMinPrec, &rhs, posLeft)) {
+            return ParseNoMatch;
+        }
+        pos = *posLeft;
+        Ast *ast = parser->ast;
+        NodeIndex binOp = addNode(ast, BinaryOp, ast->nodes[lhs].start, nodeEnd(&ast->nodes[rhs]));
+        ast->nodes[binOp].op = op;
+        ast->nodes[binOp].data.binOp.lhs = lhs;
+        ast->nodes[binOp].data.binOp.rhs = rhs;
+        lhs = binOp;
+    }
+    *resultNode = lhs;
+    *posLeft = pos;
+    return ParseSuccess;
+}
+
+ParseError parseVarAssign(
+    Parser *parser,
+    int pos,
+    NodeIndex *resultNode,
+    int *posLeft
+) {
+    int typeIdPos = pos;
+    if (tokenTypeAt(parser, typeIdPos) != Id) {
+        *posLeft = typeIdPos;
+        return ParseNoMatch;
+    }
+    int varNamePos = pos + 1;
+    if (tokenTypeAt(parser, varNamePos) != Id) {
+        *posLeft = varNamePos;
+        return ParseNoMatch;
+    }
+    int assignPos = pos + 2;
+    if (tokenTypeAt(parser, assignPos) != AssignOp) {
+        *posLeft = assignPos;
+        return ParseNoMatch;
+    }
+    NodeIndex initValue;
+    int left;
+    int result = parseExpr(parser, assignPos + 1, &initValue, &left);
+    if (result != ParseSuccess) {
+        *posLeft = left;
+        return result;
+    }
+
+    *posLeft = left;
+
+    // Create the node
+    Ast *ast = parser->ast;
+    int base = ast->scratchCount;
+    pushScratch(ast, createTokenNode(parser, TypeIdentifier, typeIdPos));
+    pushScratch(ast, createTokenNode(parser, Identifier, varNamePos));
+    pushScratch(ast, initValue);
+    NodeIndex varAssign = addNode(
+        ast, VarAssign, parser->tokens->offsets[typeIdPos], nodeEnd(&ast->nodes[initValue])
+    );
+    setChildrenFromScratch(ast, varAssign, base);
+    *resultNode = varAssign;
+    return 0;
+}
+
+ParseError parseFunCall(
+    Parser *parser,
+    int pos,
+    NodeIndex *resultNode,
+    int *posLeft
+) {
+    int funNamePos = pos;
+    if (tokenTypeAt(parser, funNamePos) != Id) {
+        *posLeft = pos;
+        return ParseNoMatch;
+    }
+    pos++;
+    if (tokenTypeAt(parser, pos) != LeftParan) {
+        *posLeft = pos;
+        return ParseNoMatch;
+    }
+
+    pos++;
+    Ast *ast = parser->ast;
+    int base = ast->scratchCount;
+    pushScratch(ast, createTokenNode(parser, Identifier, funNamePos));
+    while (1) {
+        NodeIndex arg;
+        int left;
+        int result = parseExpr(parser, pos, &arg, &left);
+        if (result == ParseSuccess) {
+            pos = left;
+            if (tokenTypeAt(parser, pos) == EndOfInput) {
+                ast->scratchCount = base;
+                *posLeft = pos;
+                return ParseNoMatch;
+            }
+            pushScratch(ast, arg);
+            if (tokenTypeAt(parser, pos) != Comma) {
+                break;
+            } else {
+                pos++;
+            }
+        } else {
+            ast->scratchCount = base;
+            *posLeft = left;
+            return result;
+        }
+    }
+    if (tokenTypeAt(parser, pos) != RightParan) {
+        ast->scratchCount = base;
+        *posLeft = pos;
+        return ParseNoMatch;
+    }
+
+    NodeIndex retval = addNode(ast, FunCall, parser->tokens->offsets[funNamePos], tokenEnd(parser, pos));
+    setChildrenFromScratch(ast, retval, base);
+    *resultNode = retval;
+    *posLeft = pos + 1;
+    return ParseSuccess;
+}
+
+// Parses "if cond {", leaving the condition in cond and the position after
+// the { in posLeft
+ParseError parseIfHead(Parser *parser, int pos, NodeIndex *cond, int *posLeft) {
+    pos++;
+    if (ParseSuccess != parseExpr(parser, pos, cond, posLeft)) {
+        return ParseNoMatch;
+    }
+    pos = *posLeft;
+    if (tokenTypeAt(parser, pos) != LeftBrace) {
+        return ParseNoMatch;
+    }
+    *posLeft = pos + 1;
+    return ParseSuccess;
+}
+
+// Parses "loop {", leaving the position after the { in posLeft
+ParseError parseLoopHead(Parser *parser, int pos, int *posLeft) {
+    pos++;
+    if (tokenTypeAt(parser, pos) != LeftBrace) {
+        *posLeft = pos;
+        return ParseNoMatch;
+    }
+    *posLeft = pos + 1;
+    return ParseSuccess;
+}
+
+ParseError parseBreakStatement(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft) {
+    if (tokenTypeAt(parser, pos) != BreakKeyword) {
+        *posLeft = pos;
+        return ParseNoMatch;
+    }
+    *posLeft = pos + 1;
+    *resultNode = addNode(parser->ast, BreakStatement, parser->tokens->offsets[pos], tokenEnd(parser, pos));
+    return ParseSuccess;
+}
+
+// Statements starting with an identifier are a declaration when a second
+// identifier follows (int a = ...) and a call when ( follows
+ParseError parseIdStatement(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft) {
+    TokenType next = tokenTypeAt(parser, pos + 1);
+    if (next == Id) {
+        return parseVarAssign(parser, pos, resultNode, posLeft);
+    } else if (next == LeftParan) {
+        return parseFunCall(parser, pos, resultNode, posLeft);
+    }
+    *posLeft = pos + 1;
+    return ParseNoMatch;
+}
+
+// Statements that hold no other statements
+static const NodeParser statementParsers[EndOfInput + 1] = {
+    [Id] = parseIdStatement,
+    [BreakKeyword] = parseBreakStatement,
+};
+
+// An if or loop whose body is being parsed, and how long the scratch list
+// was before its children
+typedef struct _OpenBlock {
+    NodeType type;
+    int keywordPos;
+    int base;
+} OpenBlock;
+
+#define INLINE_BLOCKS 16
+
+// Parses one statement. The bodies of ifs and loops are parsed by the same
+// loop, with the blocks still open on an explicit stack instead of the C
+// stack, so how deeply blocks nest is limited only by memory.
+ParseError parseStatement(Parser *parser, int pos, NodeIndex *resultNode, int *posLeft) {
+    Ast *ast = parser->ast;
+    int count = ast->count;
+    int extraCount = ast->extraCount;
+    int scratchBase = ast->scratchCount;
+    OpenBlock inlineBlocks[INLINE_BLOCKS];
+    OpenBlock *blocks = inlineBlocks;
+    int blockCount = 0;
+    int blockCapacity = INLINE_BLOCKS;
+    ParseError result = ParseSuccess;
+    while (result == ParseSuccess) {
+        TokenType type = tokenTypeAt(parser, pos);
+        NodeIndex node;
+        int done;
+        if (type == IfKeyword || type == LoopKeyword) {
+            NodeIndex cond;
+            result = type == IfKeyword
+                ? parseIfHead(parser, pos, &cond, posLeft)
+                : parseLoopHead(parser, pos, posLeft);
+            if (result != ParseSuccess) {
+                break;
+            }
+            if (blockCount == blockCapacity) {
+                blockCapacity *= 2;
+                if (blocks == inlineBlocks) {
+                    blocks = malloc(sizeof (OpenBlock) * blockCapacity);
+                    memcpy(blocks, inlineBlocks, sizeof (inlineBlocks));
+                } else {
+                    blocks = realloc(blocks, sizeof (OpenBlock) * blockCapacity);
+                }
+            }
+            OpenBlock *block = &blocks[blockCount++];
+            block->type = type == IfKeyword ? IfStatement : LoopStatement;
+            block->keywordPos = pos;
+            block->base = ast->scratchCount;
+            if (type == IfKeyword) {
+                pushScratch(ast, cond);
+            }
+            done = 0;
+        } else {
+            NodeParser statementParser = statementParsers[type];
+            if (statementParser == NULL) {
+                *posLeft = pos;
+                result = ParseNoMatch;
+                break;
+            }
+            result = statementParser(parser, pos, &node, posLeft);
+            if (result != ParseSuccess) {
+                break;
+            }
+            done = 1;
+        }
+        pos = *posLeft;
+        // A finished statement goes to the innermost open block, and a }
+        // then finishes that block in turn
+        while (1) {
+            if (done) {
+                if (blockCount == 0) {
+                    *resultNode = node;
+                    *posLeft = pos;
+                    break;
+                }
+                pushScratch(ast, node);
+            }
+            while (isBlankToken(tokenTypeAt(parser, pos))) {
+                pos++;
+            }
+            TokenType next = tokenTypeAt(parser, pos);
+            if (next == EndOfInput) {
+                *posLeft = pos;
+                result = ParseNoMatch;
+                break;
+            }
+            if (next != RightBrace) {
+                break;
+            }
+            OpenBlock *block = &blocks[--blockCount];
+            node = addNode(ast, block->type, parser->tokens->offsets[block->keywordPos], tokenEnd(parser, pos));
+            setChildrenFromScratch(ast, node, block->base);
+            pos++;
+            done = 1;
+        }
+        if (done && blockCount == 0) {
+            break;
+        }
+    }
+    if (blocks != inlineBlocks) {
+        free(blocks);
+    }
+    // Whatever a failed statement added is dropped again
+    if (result != ParseSuccess) {
+        ast->count = count;
+        ast->extraCount = extraCount;
+        ast->scratchCount = scratchBase;
+    }
+    return result;
+}
+
+// Pushes the statements up to the next } or the end onto the scratch list
+ParseError parseStatements(Parser *parser, int pos, int *posLeft) {
+    int base = parser->ast->scratchCount;
+    while (isBlankToken(tokenTypeAt(parser, pos))) {
+        pos++;
+    }
+    while (1) {
+        TokenType type = tokenTypeAt(parser, pos);
+        if (type == RightBrace || type == EndOfInput) {
+            break;
+        }
+        NodeIndex stmtNode;
+        int stmtPosLeft;
+        if (ParseSuccess != parseStatement(parser, pos, &stmtNode, &stmtPosLeft)) {
+            // With a single path through each statement, the furthest
+            // position reached is where the error is
+            parser->ast->scratchCount = base;
+            *posLeft = stmtPosLeft;
+            return ParseNoMatch;
+        }
+        pushScratch(parser->ast, stmtNode);
+        pos = stmtPosLeft;
+        while (isBlankToken(tokenTypeAt(parser, pos))) {
+            pos++;
+        }
+    }
+    (*posLeft) = pos;
+    return ParseSuccess;
+}
+
+ParseError parse(Parser *parser, NodeIndex *resultNode, int *posLeft) {
+    Ast *ast = parser->ast;
+    int base = ast->scratchCount;
+    if (ParseSuccess != parseStatements(parser, 0, posLeft)) {
+        return ParseNoMatch;
+    }
+
+    NodeIndex program = addNode(ast, Program, 0, 0);
+    setChildrenFromScratch(ast, program, base);
+    *resultNode = program;
+    if (tokenTypeAt(parser, *posLeft) != EndOfInput) {
+        return ParseExtraTokens;
+    }
+    return ParseSuccess;
+}
+
+// One replaced byte range, in offsets of the text before the edit
+typedef struct _SourceEdit {
+    int64_t start;
+    int64_t oldLength;
+    int64_t newLength;
+} SourceEdit;
+
+// A top-level statement with the tokens it was parsed from, so that an edit
+// can be mapped to the statements it touches. nodeCount is the number of
+// nodes parsing it added, and shift how many bytes the starts of those nodes
+// are behind the text they were parsed from (see Document).
+typedef struct _TopLevelStatement {
+    NodeIndex node;
+    int firstToken;
+    int endToken;
+    uint32_t nodeCount;
+    int64_t shift;
+} TopLevelStatement;
+
+// What is kept between edits for incremental re-parsing. Tokens, line
+// starts and top-level statements each live in an array with a gap at the
+// last edit: [0, gap) is up to date, and [tail, end) is what follows the
+// edit, kept tailDelta bytes and tailTokenDelta tokens behind. An edit then
+// only moves what lies between it and the edit before. The starts of a
+// statement's nodes are a further shift bytes behind and are brought up to
+// date by settleDocument, before the tree is read. While re-parsing, the
+// token gap holds an EndOfInput that stops the parser at its edge. Nodes of
+// replaced statements stay in the tree until they outnumber the live ones,
+// when the document is rebuilt.
+typedef struct _Document {
+    Source source;
+    Interner interner;
+    TokenArray tokens;
+    int tokenGap;
+    int tokenTail;
+    int lineGap;
+    int lineTail;
+    int64_t tailDelta;
+    int tailTokenDelta;
+    Ast ast;
+    NodeIndex program;
+    uint32_t programCapacity;
+    uint32_t liveNodes;
+    TopLevelStatement *statements;
+    int statementGap;
+    int statementTail;
+    int statementEnd;
+    int statementCapacity;
+    int valid;
+    int settled;
+} Document;
+
+void initDocument(Document *doc) {
+    memset(doc, 0, sizeof (Document));
+    initInterner(&doc->interner);
+    initAst(&doc->ast);
+    initTokenArray(&doc->tokens, 256);
+    doc->statementCapacity = 64;
+    doc->statements = malloc(sizeof (TopLevelStatement) * doc->statementCapacity);
+}
+
+void freeDocument(Document *doc) {
+    free(doc->statements);
+    freeTokenArray(&doc->tokens);
+    freeAst(&doc->ast);
+    freeInterner(&doc->interner);
+}
+
+void initDocumentParser(Document *doc, Parser *parser) {
+    parser->source = &doc->source;
+    parser->tokens = &doc->tokens;
+    parser->ast = &doc->ast;
+    parser->interner = &doc->interner;
+}
+
+int documentTokenCount(Document *doc) {
+    return doc->tokenGap + doc->tokens.count - doc->tokenTail;
+}
+
+int documentLineCount(Document *doc) {
+    return doc->lineGap + doc->tokens.lineCount - doc->lineTail;
+}
+
+int documentStatementCount(Document *doc) {
+    return doc->statementGap + doc->statementEnd - doc->statementTail;
+}
+
+// End offset of token i of the current text
+int64_t documentTokenEnd(Document *doc, int i) {
+    TokenArray *tokens = &doc->tokens;
+    if (i < doc->tokenGap) {
+        return tokens->offsets[i] + tokens->lengths[i];
+    }
+    int slot = i + doc->tokenTail - doc->tokenGap;
+    return tokens->offsets[slot] + tokens->lengths[slot] + doc->tailDelta;
+}
+
+// Start offset of line i (from 0) of the current text
+int64_t documentLineStart(Document *doc, int i) {
+    if (i < doc->lineGap) {
+        return doc->tokens.lineStarts[i];
+    }
+    return doc->tokens.lineStarts[i + doc->lineTail - doc->lineGap] + doc->tailDelta;
+}
+
+// Token after the end of top-level statement i of the current text
+int statementEndToken(Document *doc, int i) {
+    if (i < doc->statementGap) {
+        return doc->statements[i].endToken;
+    }
+    return doc->statements[i + doc->statementTail - doc->statementGap].endToken + doc->tailTokenDelta;
+}
+
+// Moves count tokens from index from to index to, in all token arrays
+void moveTokens(TokenArray *tokens, int to, int from, int count) {
+    memmove(tokens->types + to, tokens->types + from, sizeof (TokenType) * count);
+    memmove(tokens->values + to, tokens->values + from, sizeof (uint32_t) * count);
+    memmove(tokens->offsets + to, tokens->offsets + from, sizeof (int64_t) * count);
+    memmove(tokens->lengths + to, tokens->lengths + from, sizeof (int) * count);
+}
+
+// Moves the token gap to just before token to of the current text. Tokens
+// crossing it towards the front are brought up to date and tokens crossing
+// it towards the back are put tailDelta behind.
+void moveTokenGap(Document *doc, int to) {
+    TokenArray *tokens = &doc->tokens;
+    int gap = doc->tokenGap;
+    int tail = doc->tokenTail;
+    if (to > gap) {
+        moveTokens(tokens, gap, tail, to - gap);
+        for (int i = gap; i < to; i++) {
+            tokens->offsets[i] += doc->tailDelta;
+        }
+    } else if (to < gap) {
+        moveTokens(tokens, tail - (gap - to), to, gap - to);
+        for (int i = tail - (gap - to); i < tail; i++) {
+            tokens->offsets[i] -= doc->tailDelta;
+        }
+    }
+    doc->tokenTail = tail + to - gap;
+    doc->tokenGap = to;
+    if (to < doc->tokenTail) {
+        tokens->types[to] = EndOfInput;
+    }
+}
+
+// Makes the token gap at least count tokens wide. The arrays grow by a
+// share of what they hold, so that an edit seldom has to move the tail.
+void reserveTokenGap(Document *doc, int count) {
+    TokenArray *tokens = &doc->tokens;
+    if (doc->tokenTail - doc->tokenGap >= count) {
+        return;
+    }
+    int tail = tokens->count - doc->tokenTail;
+    int needed = doc->tokenGap + count + tail + 1 + (doc->tokenGap + tail) / 4;
+    if (needed > tokens->capacity) {
+        int capacity = tokens->capacity;
+        while (needed > capacity) {
+            capacity *= 2;
+        }
+        tokens->types = realloc(tokens->types, sizeof (TokenType) * capacity);
+        tokens->values = realloc(tokens->values, sizeof (uint32_t) * capacity);
+        tokens->offsets = realloc(tokens->offsets, sizeof (int64_t) * capacity);
+        tokens->lengths = realloc(tokens->lengths, sizeof (int) * capacity);
+        tokens->capacity = capacity;
+        tokens->allocations += 4;
+    }
+    int end = tokens->capacity - 1;
+    moveTokens(tokens, end - tail, doc->tokenTail, tail);
+    doc->tokenTail = end - tail;
+    tokens->count = end;
+    tokens->types[end] = EndOfInput;
+}
+
+// moveTokenGap for line starts
+void moveLineGap(Document *doc, int to) {
+    int64_t *lineStarts = doc->tokens.lineStarts;
+    int gap = doc->lineGap;
+    int tail = doc->lineTail;
+    if (to > gap) {
+        memmove(lineStarts + gap, lineStarts + tail, sizeof (int64_t) * (to - gap));
+        for (int i = gap; i < to; i++) {
+            lineStarts[i] += doc->tailDelta;
+        }
+    } else if (to < gap) {
+        memmove(lineStarts + tail - (gap - to), lineStarts + to, sizeof (int64_t) * (gap - to));
+        for (int i = tail - (gap - to); i < tail; i++) {
+            lineStarts[i] -= doc->tailDelta;
+        }
+    }
+    doc->lineTail = tail + to - gap;
+    doc->lineGap = to;
+}
+
+// reserveTokenGap for line starts
+void reserveLineGap(Document *doc, int count) {
+    TokenArray *tokens = &doc->tokens;
+    if (doc->lineTail - doc->lineGap >= count) {
+        return;
+    }
+    int tail = tokens->lineCount - doc->lineTail;
+    int needed = doc->lineGap + count + tail + (doc->lineGap + tail) / 4;
+    if (needed > tokens->lineCapacity) {
+        while (needed > tokens->lineCapacity) {
+            tokens->lineCapacity *= 2;
+        }
+        tokens->lineStarts = realloc(
+            tokens->lineStarts, sizeof (int64_t) * tokens->lineCapacity
+        );
+        tokens->allocations++;
+    }
+    int end = tokens->lineCapacity;
+    memmove(tokens->lineStarts + end - tail, tokens->lineStarts + doc->lineTail, sizeof (int64_t) * tail);
+    doc->lineTail = end - tail;
+    tokens->lineCount = end;
+}
+
+// moveTokenGap for top-level statements, whose token range and node starts
+// are kept behind while they follow the gap
+void moveStatementGap(Document *doc, int to) {
+    TopLevelStatement *statements = doc->statements;
+    int gap = doc->statementGap;
+    int tail = doc->statementTail;
+    while (gap < to) {
+        TopLevelStatement statement = statements[tail++];
+        statement.firstToken += doc->tailTokenDelta;
+        statement.endToken += doc->tailTokenDelta;
+        statement.shift += doc->tailDelta;
+        statements[gap++] = statement;
+    }
+    while (gap > to) {
+        TopLevelStatement statement = statements[--gap];
+        statement.firstToken -= doc->tailTokenDelta;
+        statement.endToken -= doc->tailTokenDelta;
+        statement.shift -= doc->tailDelta;
+        statements[--tail] = statement;
+    }
+    doc->statementGap = gap;
+    doc->statementTail = tail;
+}
+
+// reserveTokenGap for top-level statements
+void reserveStatementGap(Document *doc, int count) {
+    if (doc->statementTail - doc->statementGap >= count) {
+        return;
+    }
+    int tail = doc->statementEnd - doc->statementTail;
+    int needed = doc->statementGap + count + tail + (doc->statementGap + tail) / 4;
+    if (needed > doc->statementCapacity) {
+        while (needed > doc->statementCapacity) {
+            doc->statementCapacity *= 2;
+        }
+        doc->statements = realloc(
+            doc->statements, sizeof (TopLevelStatement) * doc->statementCapacity
+        );
+    }
+    int end = doc->statementCapacity;
+    memmove(
+        doc->statements + end - tail,
+        doc->statements + doc->statementTail,
+        sizeof (TopLevelStatement) * tail
+    );
+    doc->statementTail = end - tail;
+    doc->statementEnd = end;
+}
+
+// Closes the token and line gaps, leaving both arrays as tokenize makes
+// them, for reporting an error
+void closeDocumentGaps(Document *doc) {
+    moveTokenGap(doc, documentTokenCount(doc));
+    doc->tokens.count = doc->tokenGap;
+    doc->tokenTail = doc->tokenGap;
+    moveLineGap(doc, documentLineCount(doc));
+    doc->tokens.lineCount = doc->lineGap;
+    doc->lineTail = doc->lineGap;
+}
+
+// Parses top-level statements from pos into out, stopping at the end of
+// input, at a stray } or, when stopAt is given, at the first statement
+// start it accepts. Like parseStatements, but keeps the token range of
+// every statement.
+ParseError parseTopLevel(
+    Parser *parser,
+    int pos,
+    int (*stopAt)(void *context, int pos),
+    void *context,
+    TopLevelStatement **out,
+    int *outCount,
+    int *posLeft
+) {
+    int capacity = 16;
+    int count = 0;
+    TopLevelStatement *statements = malloc(sizeof (TopLevelStatement) * capacity);
+    while (isBlankToken(tokenTypeAt(parser, pos))) {
+        pos++;
+    }
+    while (tokenTypeAt(parser, pos) != EndOfInput && tokenTypeAt(parser, pos) != RightBrace) {
+        if (stopAt != NULL && stopAt(context, pos)) {
+            break;
+        }
+        NodeIndex stmtNode;
+        int stmtPosLeft;
+        int nodeCount = parser->ast->count;
+        if (ParseSuccess != parseStatement(parser, pos, &stmtNode, &stmtPosLeft)) {
+            free(statements);
+            *posLeft = stmtPosLeft;
+            return ParseNoMatch;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            statements = realloc(statements, sizeof (TopLevelStatement) * capacity);
+        }
+        statements[count].node = stmtNode;
+        statements[count].firstToken = pos;
+        statements[count].endToken = stmtPosLeft;
+        statements[count].nodeCount = parser->ast->count - nodeCount;
+        statements[count].shift = 0;
+        count++;
+        pos = stmtPosLeft;
+        while (isBlankToken(tokenTypeAt(parser, pos))) {
+            pos++;
+        }
+    }
+    *out = statements;
+    *outCount = count;
+    *posLeft = pos;
+    return ParseSuccess;
+}
+
+// Moves the tree under index by offsetDelta bytes
+void shiftLocations(Ast *ast, NodeIndex index, int64_t offsetDelta) {
+    WalkStack stack;
+    initWalkStack(&stack);
+    pushWalk(&stack, index, 0);
+    while (stack.count > 0) {
+        Node *node = nodeAt(ast, stack.frames[--stack.count].node);
+        node->start += offsetDelta;
+        for (uint32_t i = childCount(node); i > 0; i--) {
+            pushWalk(&stack, childIndex(ast, node, i - 1), 0);
+        }
+    }
+    freeWalkStack(&stack);
+}
+
+// Moves the nodes of every statement to where its text now is, and points
+// the program node at the statements
+void settleDocument(Document *doc) {
+    if (doc->settled) {
+        return;
+    }
+    Ast *ast = &doc->ast;
+    uint32_t count = documentStatementCount(doc);
+    if (count > doc->programCapacity) {
+        doc->programCapacity = 2 * count;
+        ast->nodes[doc->program].data.children.start = addExtra(ast, doc->programCapacity);
+    }
+    Node *program = nodeAt(ast, doc->program);
+    for (uint32_t i = 0; i < count; i++) {
+        int after = i >= (uint32_t)doc->statementGap;
+        TopLevelStatement *statement = &doc->statements[
+            after ? i + doc->statementTail - doc->statementGap : i
+        ];
+        int64_t behind = statement->shift + (after ? doc->tailDelta : 0);
+        if (behind != 0) {
+            shiftLocations(ast, statement->node, behind);
+            statement->shift -= behind;
+        }
+        ast->extra[program->data.children.start + i] = statement->node;
+    }
+    program->data.children.count = count;
+    doc->settled = 1;
+}
+
+// Lexes and parses the whole of doc->source from scratch
+ParseError buildDocument(Document *doc, TokenizeErrorType *lexResult, int *posLeft) {
+    TokenizeErrorInfo errorInfo;
+    doc->valid = 0;
+    freeTokenArray(&doc->tokens);
+    resetAst(&doc->ast);
+    doc->programCapacity = 0;
+    doc->tailDelta = 0;
+    doc->tailTokenDelta = 0;
+    doc->statementGap = 0;
+    doc->statementTail = 0;
+    doc->statementEnd = 0;
+    *lexResult = tokenize(&doc->source, &doc->interner, &doc->tokens, &errorInfo);
+    if (*lexResult != LexSuccess) {
+        // tokenize frees a failed array; keep one around for freeDocument
+        initTokenArray(&doc->tokens, 256);
+    }
+    doc->tokenGap = doc->tokens.count;
+    doc->tokenTail = doc->tokens.count;
+    doc->lineGap = doc->tokens.lineCount;
+    doc->lineTail = doc->tokens.lineCount;
+    if (*lexResult != LexSuccess) {
+        *posLeft = 0;
+        return ParseNoMatch;
+    }
+    Parser parser;
+    initDocumentParser(doc, &parser);
+    TopLevelStatement *statements;
+    int count;
+    if (ParseSuccess != parseTopLevel(&parser, 0, NULL, NULL, &statements, &count, posLeft)) {
+        return ParseNoMatch;
+    }
+    if (tokenTypeAt(&parser, *posLeft) != EndOfInput) {
+        free(statements);
+        return ParseExtraTokens;
+    }
+    reserveStatementGap(doc, count);
+    memcpy(doc->statements, statements, sizeof (TopLevelStatement) * count);
+    doc->statementGap = count;
+    free(statements);
+    doc->program = addNode(&doc->ast, Program, 0, 0);
+    doc->liveNodes = doc->ast.count;
+    doc->settled = 0;
+    settleDocument(doc);
+    doc->valid = 1;
+    return ParseSuccess;
+}
+
+// Index of the first token in [low, count) whose offset is at least offset
+int findTokenAt(TokenArray *tokens, int low, int64_t offset) {
+    int high = tokens->count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (tokens->offsets[mid] < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Brings doc up to date with newSource, which is the old text with edits
+// applied. Edits are in old offsets, in order and not overlapping. Only the
+// lines from the first edit up to the next newline that lexes the same as
+// before are re-lexed, and only the top-level statements covering them are
+// re-parsed; the tokens and statements past them stay behind the gaps
+// untouched, so an edit costs what it damages and its distance from the
+// edit before, not the length of the text.
+ParseError editDocument(
+    Document *doc,
+    Source *newSource,
+    SourceEdit *edits,
+    int editCount,
+    TokenizeErrorType *lexResult,
+    int *posLeft
+) {
+    doc->source = *newSource;
+    if (!doc->valid || editCount == 0) {
+        return buildDocument(doc, lexResult, posLeft);
+    }
+    TokenArray *tokens = &doc->tokens;
+    int64_t editStart = edits[0].start;
+    int64_t oldEditEnd = edits[editCount - 1].start + edits[editCount - 1].oldLength;
+    int64_t delta = 0;
+    for (int i = 0; i < editCount; i++) {
+        delta += edits[i].newLength - edits[i].oldLength;
+    }
+    int64_t newEditEnd = oldEditEnd + delta;
+
+    // Re-lex from the start of the line holding the first token that ends
+    // at or after the edit, since that token may grow into the new text
+    int first = 0;
+    int high = documentTokenCount(doc);
+    while (first < high) {
+        int mid = first + (high - first) / 2;
+        if (documentTokenEnd(doc, mid) < editStart) {
+            first = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    moveTokenGap(doc, first);
+    while (first > 0 && tokens->types[first - 1] != Newline) {
+        first--;
+    }
+    moveTokenGap(doc, first);
+    int64_t lexStart = first > 0 ? tokens->offsets[first - 1] + 1 : 0;
+
+    // Lex a line at a time past the edit until a newline token lines up with
+    // one in the old tokens, which all follow the gap now; a newline inside
+    // a string just extends the line
+    TokenArray fresh;
+    Lexer lexer;
+    initLexer(&lexer, &doc->interner, &fresh);
+    lexer.baseOffset = lexStart;
+    char *data = newSource->data;
+    int64_t len = newSource->len;
+    int64_t pos = lexStart;
+    int64_t scanFrom = newEditEnd > lexStart ? newEditEnd : lexStart;
+    int oldEnd = tokens->count;
+    int64_t oldLexEnd = INT64_MAX;
+    TokenizeErrorInfo errorInfo;
+    *lexResult = LexSuccess;
+    while (1) {
+        char *newline = scanFrom < len ? memchr(data + scanFrom, '\n', len - scanFrom) : NULL;
+        int64_t segmentEnd = newline != NULL ? newline - data + 1 : len;
+        int final = newline == NULL;
+        size_t consumed;
+        *lexResult = lexChunk(&lexer, data + pos, segmentEnd - pos, final, &consumed, &errorInfo);
+        if (*lexResult != LexSuccess || final) {
+            break;
+        }
+        pos += consumed;
+        scanFrom = segmentEnd;
+        int last = fresh.count - 1;
+        if (last < 0 || fresh.types[last] != Newline || fresh.offsets[last] != segmentEnd - 1) {
+            continue;
+        }
+        int64_t oldOffset = segmentEnd - 1 - delta - doc->tailDelta;
+        int k = findTokenAt(tokens, doc->tokenTail, oldOffset);
+        if (k < tokens->count && tokens->types[k] == Newline && tokens->offsets[k] == oldOffset) {
+            oldEnd = k + 1;
+            oldLexEnd = segmentEnd - delta;
+            break;
+        }
+    }
+    finishLexer(&lexer, *lexResult);
+    if (*lexResult != LexSuccess) {
+        doc->valid = 0;
+        *posLeft = 0;
+        return ParseNoMatch;
+    }
+
+    // Re-parse from the first statement reaching into the damaged tokens, or
+    // from the damage itself when it lies between statements
+    int firstStatement = 0;
+    high = documentStatementCount(doc);
+    while (firstStatement < high) {
+        int mid = firstStatement + (high - firstStatement) / 2;
+        if (statementEndToken(doc, mid) <= first) {
+            firstStatement = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    moveStatementGap(doc, firstStatement);
+    int reparseFrom = first;
+    if (doc->statementTail < doc->statementEnd &&
+            doc->statements[doc->statementTail].firstToken + doc->tailTokenDelta < first) {
+        reparseFrom = doc->statements[doc->statementTail].firstToken + doc->tailTokenDelta;
+    }
+
+    // The line starts in (lexStart, oldLexEnd] are the ones lexed again
+    int firstLine = 0;
+    high = documentLineCount(doc);
+    while (firstLine < high) {
+        int mid = firstLine + (high - firstLine) / 2;
+        if (documentLineStart(doc, mid) <= lexStart) {
+            firstLine = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    moveLineGap(doc, firstLine);
+    while (doc->lineTail < tokens->lineCount &&
+            tokens->lineStarts[doc->lineTail] + doc->tailDelta <= oldLexEnd) {
+        doc->lineTail++;
+    }
+
+    // Put the new tokens and line starts in the gaps in place of the old
+    int tokenDelta = fresh.count - (oldEnd - doc->tokenTail);
+    doc->tokenTail = oldEnd;
+    reserveTokenGap(doc, fresh.count + 1);
+    int n = fresh.count;
+    memcpy(tokens->types + doc->tokenGap, fresh.types, sizeof (TokenType) * n);
+    memcpy(tokens->values + doc->tokenGap, fresh.values, sizeof (uint32_t) * n);
+    memcpy(tokens->offsets + doc->tokenGap, fresh.offsets, sizeof (int64_t) * n);
+    memcpy(tokens->lengths + doc->tokenGap, fresh.lengths, sizeof (int) * n);
+    doc->tokenGap += n;
+    tokens->types[doc->tokenGap] = EndOfInput;
+    // The fresh array's first line start is the 0 every array starts with
+    int newLines = fresh.lineCount - 1;
+    reserveLineGap(doc, newLines);
+    memcpy(tokens->lineStarts + doc->lineGap, fresh.lineStarts + 1, sizeof (int64_t) * newLines);
+    doc->lineGap += newLines;
+    freeTokenArray(&fresh);
+    doc->tailDelta += delta;
+    doc->tailTokenDelta += tokenDelta;
+    doc->settled = 0;
+
+    // Re-parse up to the gap. The old statements after it are taken up again
+    // when the parse reaches the gap between statements and the gap does not
+    // cut an old statement, since top-level statements parse the same
+    // whatever comes before them. Otherwise the gap moves on over twice as
+    // many tokens and the parse is tried again.
+    Parser parser;
+    initDocumentParser(doc, &parser);
+    Ast *ast = &doc->ast;
+    int nodeMark = ast->count;
+    int extraMark = ast->extraCount;
+    TopLevelStatement *reparsed;
+    int reparsedCount;
+    ParseError result;
+    while (1) {
+        while (doc->statementTail < doc->statementEnd) {
+            TopLevelStatement *statement = &doc->statements[doc->statementTail];
+            if (statement->firstToken + doc->tailTokenDelta >= doc->tokenGap) {
+                break;
+            }
+            if (statement->endToken + doc->tailTokenDelta > doc->tokenGap) {
+                moveTokenGap(doc, statement->endToken + doc->tailTokenDelta);
+            }
+            doc->liveNodes -= statement->nodeCount;
+            doc->statementTail++;
+        }
+        result = parseTopLevel(&parser, reparseFrom, NULL, NULL, &reparsed, &reparsedCount, posLeft);
+        if (doc->tokenTail == tokens->count || (result == ParseSuccess && (
+                *posLeft == doc->tokenGap || tokens->types[*posLeft] == RightBrace))) {
+            break;
+        }
+        if (result == ParseSuccess) {
+            free(reparsed);
+        }
+        ast->count = nodeMark;
+        ast->extraCount = extraMark;
+        int to = doc->tokenGap + 2 * (doc->tokenGap - reparseFrom) + 1;
+        int count = documentTokenCount(doc);
+        moveTokenGap(doc, to < count ? to : count);
+    }
+    if (result != ParseSuccess || tokens->types[*posLeft] == RightBrace) {
+        if (result == ParseSuccess) {
+            free(reparsed);
+            result = ParseExtraTokens;
+        }
+        doc->valid = 0;
+        closeDocumentGaps(doc);
+        return result;
+    }
+    reserveStatementGap(doc, reparsedCount);
+    memcpy(
+        doc->statements + doc->statementGap,
+        reparsed,
+        sizeof (TopLevelStatement) * reparsedCount
+    );
+    doc->statementGap += reparsedCount;
+    free(reparsed);
+    doc->liveNodes += ast->count - nodeMark;
+    *posLeft = documentTokenCount(doc);
+    if ((uint32_t)ast->count - doc->liveNodes > doc->liveNodes) {
+        return buildDocument(doc, lexResult, posLeft);
+    }
+    return ParseSuccess;
+}
+
+// Below this many tokens per thread a file is not worth splitting
+#define PARALLEL_MIN_TOKENS 65536
+
+typedef struct _ParseRange {
+    Parser parser;
+    Ast ast;
+    int start;
+    int end;
+    TopLevelStatement *statements;
+    int count;
+    ParseError result;
+    int posLeft;
+    pthread_t thread;
+} ParseRange;
+
+int rangeStopAt(void *context, int pos) {
+    return pos >= ((ParseRange *)context)->end;
+}
+
+void *parseRange(void *arg) {
+    ParseRange *range = arg;
+    range->result = parseTopLevel(
+        &range->parser, range->start, rangeStopAt, range,
+        &range->statements, &range->count, &range->posLeft
+    );
+    return NULL;
+}
+
+// Same result as parse, with the top-level statements parsed on up to
+// threadCount threads. A newline outside any braces always ends a
+// top-level statement, so the tokens are cut after such newlines into
+// ranges of about equal size. Each range is parsed into its own tree, and
+// the trees are appended to the first in order. The first range that stopped
+// early decides the error, as it would have in a serial parse.
+ParseError parseParallel(Parser *parser, int threadCount, NodeIndex *resultNode, int *posLeft) {
+    TokenArray *tokens = parser->tokens;
+    int maxRanges = tokens->count / PARALLEL_MIN_TOKENS;
+    if (threadCount > maxRanges) {
+        threadCount = maxRanges;
+    }
+    if (threadCount <= 1) {
+        return parse(parser, resultNode, posLeft);
+    }
+    ParseRange *ranges = malloc(sizeof (ParseRange) * threadCount);
+    int rangeCount = 0;
+    int start = 0;
+    int depth = 0;
+    for (int i = 0; i < tokens->count && rangeCount < threadCount - 1; i++) {
+        TokenType type = tokens->types[i];
+        if (type == LeftBrace) {
+            depth++;
+        } else if (type == RightBrace) {
+            depth--;
+        } else if (type == Newline && depth == 0 &&
+                i + 1 >= (int64_t)tokens->count * (rangeCount + 1) / threadCount) {
+            ranges[rangeCount].start = start;
+            ranges[rangeCount].end = i + 1;
+            rangeCount++;
+            start = i + 1;
+        }
+    }
+    ranges[rangeCount].start = start;
+    ranges[rangeCount].end = tokens->count;
+    rangeCount++;
+
+    for (int i = 0; i < rangeCount; i++) {
+        ParseRange *range = &ranges[i];
+        range->parser = *parser;
+        if (i > 0) {
+            initAst(&range->ast);
+            range->parser.ast = &range->ast;
+            pthread_create(&range->thread, NULL, parseRange, range);
+        }
+    }
+    parseRange(&ranges[0]);
+    for (int i = 1; i < rangeCount; i++) {
+        pthread_join(ranges[i].thread, NULL);
+    }
+
+    Ast *ast = parser->ast;
+    int base = ast->scratchCount;
+    ParseError result = ParseSuccess;
+    for (int i = 0; i < rangeCount && result == ParseSuccess; i++) {
+        ParseRange *range = &ranges[i];
+        if (range->result == ParseSuccess) {
+            NodeIndex nodeBase = i > 0 ? appendAst(ast, &range->ast) : 0;
+            for (int j = 0; j < range->count; j++) {
+                pushScratch(ast, range->statements[j].node + nodeBase);
+            }
+        }
+        if (range->result != ParseSuccess) {
+            result = ParseNoMatch;
+            *posLeft = range->posLeft;
+        } else if (tokenTypeAt(parser, range->posLeft) == RightBrace) {
+            result = ParseExtraTokens;
+            *posLeft = range->posLeft;
+        } else {
+            *posLeft = range->posLeft;
+        }
+    }
+    for (int i = 0; i < rangeCount; i++) {
+        if (ranges[i].result == ParseSuccess) {
+            free(ranges[i].statements);
+        }
+        if (i > 0) {
+            freeAst(&ranges[i].ast);
+        }
+    }
+    free(ranges);
+    if (result == ParseNoMatch) {
+        ast->scratchCount = base;
+        return result;
+    }
+    NodeIndex program = addNode(ast, Program, 0, 0);
+    setChildrenFromScratch(ast, program, base);
+    *resultNode = program;
+    return result;
+}
+
+// Constant folding and dead code removal between parse and the back ends.
+// Folded expressions are rewritten in place into IntLiterals and dropped
+// statements are left out of their lists, staying behind unreferenced in
+// the tree. An int variable is propagated when its only assignment is a
+// top-level statement with a constant value, since top-level statements
+// run in order and every later use sees that value.
+typedef struct _Optimizer {
+    Ast *ast;
+    Symbol intSymbol;
+    int *assignCounts;
+    int *known;
+    int *values;
+    int loopDepth;
+    WalkStack walk;
+} Optimizer;
+
+// How a list of statements on the optimizer's walk stack is kept: inline
+// lists are the bodies of ifs that are always taken, whose statements go
+// into the list around them
+typedef enum _OptimizerList {
+    ListTopLevel = 1,
+    ListInline = 2,
+} OptimizerList;
+
+void countAssignments(Optimizer *optimizer, NodeIndex program) {
+    Ast *ast = optimizer->ast;
+    WalkStack *walk = &optimizer->walk;
+    pushWalk(walk, program, 0);
+    while (walk->count > 0) {
+        Node *node = nodeAt(ast, walk->frames[--walk->count].node);
+        if (node->type == VarAssign) {
+            optimizer->assignCounts[childAt(ast, node, 1)->data.name.id]++;
+        } else if (node->type == Program || node->type == IfStatement || node->type == LoopStatement) {
+            for (uint32_t i = 0; i < node->data.children.count; i++) {
+                pushWalk(walk, childIndex(ast, node, i), 0);
+            }
+        }
+    }
+}
+
+// Computes lhs op rhs the way the back ends do, with 64-bit ints, and
+// returns 0 when it has to be left to run time: division by zero, or a
+// result that does not fit in an IntLiteral.
+int foldBinaryOp(int op, int64_t lhs, int64_t rhs, int *result) {
+    int64_t value;
+    switch (op) {
+        case AddOp: value = lhs + rhs; break;
+        case SubtractOp: value = lhs - rhs; break;
+        case MultiplyOp: value = lhs * rhs; break;
+        case DivideOp:
+            if (rhs == 0) {
+                return 0;
+            }
+            value = lhs / rhs;
+            break;
+        case EqualOp: value = lhs == rhs; break;
+        case LessThan: value = lhs < rhs; break;
+        case LessThanOrEqual: value = lhs <= rhs; break;
+        case GreaterThan: value = lhs > rhs; break;
+        case GreaterThanOrEqual: value = lhs >= rhs; break;
+        default: return 0;
+    }
+    if (value < INT_MIN || value > INT_MAX) {
+        return 0;
+    }
+    *result = (int)value;
+    return 1;
+}
+
+// Folds the expression under node from the leaves up, skipping the name
+// of a call
+void foldExpr(Optimizer *optimizer, Node *node) {
+    Ast *ast = optimizer->ast;
+    WalkStack *walk = &optimizer->walk;
+    int base = walk->count;
+    pushWalk(walk, node - ast->nodes, node->type == FunCall ? 1 : 0);
+    while (walk->count > base) {
+        WalkFrame *frame = topWalk(walk);
+        node = nodeAt(ast, frame->node);
+        if ((node->type == BinaryOp || node->type == FunCall) && frame->next < childCount(node)) {
+            NodeIndex child = childIndex(ast, node, frame->next++);
+            pushWalk(walk, child, nodeAt(ast, child)->type == FunCall ? 1 : 0);
+            continue;
+        }
+        walk->count--;
+        if (node->type == Identifier && optimizer->known[node->data.name.id]) {
+            int value = optimizer->values[node->data.name.id];
+            node->type = IntLiteral;
+            node->data.val = value;
+        } else if (node->type == BinaryOp) {
+            Node *lhs = nodeAt(ast, node->data.binOp.lhs);
+            Node *rhs = nodeAt(ast, node->data.binOp.rhs);
+            int value;
+            if (lhs->type == IntLiteral && rhs->type == IntLiteral &&
+                    foldBinaryOp(node->op, lhs->data.val, rhs->data.val, &value)) {
+                node->type = IntLiteral;
+                node->data.val = value;
+            }
+        }
+    }
+}
+
+// Gives owner the statements pushed onto the scratch list since it held
+// base items, after its first children that are not statements. A list
+// that got longer from the statements of ifs moves to the end of extra.
+void setOptimizedList(Ast *ast, Node *owner, int first, int base) {
+    uint32_t start = owner->data.children.start;
+    uint32_t count = owner->data.children.count;
+    uint32_t kept = ast->scratchCount - base;
+    if (kept > count - first) {
+        start = addExtra(ast, first + kept);
+        memcpy(ast->extra + start, ast->extra + owner->data.children.start, sizeof (NodeIndex) * first);
+    }
+    memcpy(ast->extra + start + first, ast->scratch + base, sizeof (NodeIndex) * kept);
+    owner->data.children.start = start;
+    owner->data.children.count = first + kept;
+    ast->scratchCount = base;
+}
+
+// Optimizes the statements of program and of every block in it. Each list
+// pushes the statements it keeps onto the scratch list and is rewritten
+// from there when it ends. An if whose condition is constant is replaced
+// by nothing or by its statements, and a break in a loop ends its list,
+// along with the inline lists it is in, since nothing after it can run.
+void optimizeStatements(Optimizer *optimizer, NodeIndex program) {
+    Ast *ast = optimizer->ast;
+    WalkStack *walk = &optimizer->walk;
+    WalkFrame *frame = pushWalk(walk, program, 0);
+    frame->base = ast->scratchCount;
+    frame->mark = ListTopLevel;
+    while (walk->count > 0) {
+        frame = topWalk(walk);
+        Node *owner = nodeAt(ast, frame->node);
+        int topLevel = frame->mark & ListTopLevel;
+        if (frame->next == owner->data.children.count) {
+            WalkFrame done = *frame;
+            walk->count--;
+            if (done.mark & ListInline) {
+                continue;
+            }
+            setOptimizedList(ast, owner, owner->type == IfStatement ? 1 : 0, done.base);
+            if (owner->type == LoopStatement) {
+                optimizer->loopDepth--;
+            }
+            if (walk->count > 0) {
+                pushScratch(ast, done.node);
+            }
+            continue;
+        }
+        // Read through ast->extra every time, since lists that end can move it
+        NodeIndex index = childIndex(ast, owner, frame->next++);
+        Node *node = nodeAt(ast, index);
+        switch (node->type) {
+            case VarAssign:
+                {
+                    Symbol name = childAt(ast, node, 1)->data.name.id;
+                    Node *value = childAt(ast, node, 2);
+                    foldExpr(optimizer, value);
+                    if (topLevel && value->type == IntLiteral &&
+                            childAt(ast, node, 0)->data.name.id == optimizer->intSymbol &&
+                            optimizer->assignCounts[name] == 1) {
+                        optimizer->known[name] = 1;
+                        optimizer->values[name] = value->data.val;
+                    }
+                    break;
+                }
+            case FunCall:
+                foldExpr(optimizer, node);
+                break;
+            case IfStatement:
+                {
+                    Node *cond = childAt(ast, node, 0);
+                    foldExpr(optimizer, cond);
+                    if (cond->type != IntLiteral) {
+                        frame = pushWalk(walk, index, 1);
+                        frame->base = ast->scratchCount;
+                    } else if (cond->data.val != 0) {
+                        frame = pushWalk(walk, index, 1);
+                        frame->mark = topLevel | ListInline;
+                    }
+                    continue;
+                }
+            case LoopStatement:
+                optimizer->loopDepth++;
+                frame = pushWalk(walk, index, 0);
+                frame->base = ast->scratchCount;
+                continue;
+            case BreakStatement:
+                if (optimizer->loopDepth > 0) {
+                    pushScratch(ast, index);
+                    for (int i = walk->count - 1; i >= 0; i--) {
+                        WalkFrame *list = &walk->frames[i];
+                        list->next = nodeAt(ast, list->node)->data.children.count;
+                        if (!(list->mark & ListInline)) {
+                            break;
+                        }
+                    }
+                    continue;
+                }
+                break;
+            default:
+                break;
+        }
+        pushScratch(ast, index);
+    }
+}
+
+int totalNodes(Ast *ast, NodeIndex index) {
+    int counts[BreakStatement + 1] = {0};
+    countNodes(ast, index, counts);
+    int total = 0;
+    for (int type = 0; type <= BreakStatement; type++) {
+        total += counts[type];
+    }
+    return total;
+}
+
+// Optimizes program in place and returns how many nodes were removed
+int optimizeProgram(Interner *interner, Ast *ast, NodeIndex program) {
+    int before = totalNodes(ast, program);
+    Optimizer optimizer;
+    optimizer.ast = ast;
+    optimizer.intSymbol = intern(interner, "int", 3);
+    optimizer.assignCounts = calloc(interner->count, sizeof (int));
+    optimizer.known = calloc(interner->count, sizeof (int));
+    optimizer.values = malloc(sizeof (int) * interner->count);
+    optimizer.loopDepth = 0;
+    initWalkStack(&optimizer.walk);
+    countAssignments(&optimizer, program);
+    optimizeStatements(&optimizer, program);
+    freeWalkStack(&optimizer.walk);
+    free(optimizer.assignCounts);
+    free(optimizer.known);
+    free(optimizer.values);
+    return before - totalNodes(ast, program);
+}
+
+// Bytecode is a flat array of 32-bit words: an opcode followed by its
+// operands, if any. lines holds the source line of each opcode's word so
+// that runtime errors can point somewhere. Operations are specialized on
+// the static types checkProgram found, so values carry no type at run
+// time. A print evaluates all its arguments, prints each with OpPrintInt
+// or OpPrintStr, which take how far below the top of the stack it is, and
+// ends with OpPrintLine, which takes how many to pop. OpPushStr takes an
+// index into constants.
+typedef enum _OpCode {
+    OpPushInt,
+    OpPushStr,
+    OpLoad,
+    OpStore,
+    OpAdd,
+    OpSubtract,
+    OpMultiply,
+    OpDivide,
+    OpEqual,
+    OpLessThan,
+    OpLessThanOrEqual,
+    OpGreaterThan,
+    OpGreaterThanOrEqual,
+    OpConcat,
+    OpEqualStr,
+    OpJump,
+    OpJumpIfFalse,
+    OpPrintInt,
+    OpPrintStr,
+    OpPrintLine,
+    OpHalt,
+} OpCode;
+
+typedef struct _Bytecode {
+    int32_t *code;
+    int *lines;
+    int count;
+    int capacity;
+    int slotCount;
+    int maxStack;
+    StringPool constants;
+} Bytecode;
+
+// Operator token to opcode for ints; zero where the token is no binary
+// operator. + and == of strs have opcodes of their own.
+static const OpCode binaryOpCodes[EndOfInput + 1] = {
+    [AddOp] = OpAdd,
+    [SubtractOp] = OpSubtract,
+    [MultiplyOp] = OpMultiply,
+    [DivideOp] = OpDivide,
+    [EqualOp] = OpEqual,
+    [LessThan] = OpLessThan,
+    [LessThanOrEqual] = OpLessThanOrEqual,
+    [GreaterThan] = OpGreaterThan,
+    [GreaterThanOrEqual] = OpGreaterThanOrEqual,
+};
+
+typedef enum _CompileError {
+    CompileSuccess,
+    CompileUndefinedVariable,
+    CompileUnknownFunction,
+    CompileNoValue,
+    CompileBreakOutsideLoop,
+    CompileUnknownType,
+    CompileTypeMismatch,
+    CompileUnsupported,
+    CompileDuplicateName,
+} CompileError;
+
+static const char *compileErrorMessages[] = {
+    [CompileSuccess] = "success",
+    [CompileUndefinedVariable] = "undefined variable",
+    [CompileUnknownFunction] = "unknown function",
+    [CompileNoValue] = "print has no value",
+    [CompileBreakOutsideLoop] = "break outside of a loop",
+    [CompileUnknownType] = "unknown type",
+    [CompileTypeMismatch] = "type mismatch",
+    [CompileUnsupported] = "operator not supported on strings",
+    [CompileDuplicateName] = "variable declared again with another type",
+};
+
+// Name resolution between parse and the back ends. The program and every
+// if and loop body is a scope. An assignment to a name that is not visible
+// declares it in the innermost scope, and one to a visible name assigns to
+// that variable and has to give the type it was declared with. Every
+// declaration takes the next frame slot and a scope gives its slots back
+// when it ends, so sibling scopes share slots and a scope's frame is its
+// own slots plus the largest frame among the scopes inside it. Identifiers
+// are annotated with their slot, so the back ends address variables by
+// slot without looking anything up.
+//
+// Symbols are dense and a visible name can not be declared again, so the
+// tables of all open scopes are one array of bindings indexed by symbol,
+// and declared stacks the names of the open scopes, innermost last. The
+// slot of a declaration is simply its depth in that stack.
+typedef struct _Binding {
+    int slot; // -1 while the name is not visible
+    Symbol type;
+} Binding;
+
+typedef struct _Diagnostic {
+    CompileError error;
+    Node *node;
+} Diagnostic;
+
+// Problems found by the passes before the back ends, in source order
+typedef struct _Diagnostics {
+    Diagnostic *items;
+    int count;
+    int capacity;
+} Diagnostics;
+
+typedef struct _Resolver {
+    Ast *ast;
+    Binding *bindings;
+    Symbol *declared;
+    int declaredCount;
+    Diagnostics *diagnostics;
+    WalkStack walk;
+} Resolver;
+
+void initDiagnostics(Diagnostics *diagnostics) {
+    diagnostics->items = NULL;
+    diagnostics->count = 0;
+    diagnostics->capacity = 0;
+}
+
+void freeDiagnostics(Diagnostics *diagnostics) {
+    free(diagnostics->items);
+}
+
+void addDiagnostic(Diagnostics *diagnostics, CompileError error, Node *node) {
+    if (diagnostics->count == diagnostics->capacity) {
+        diagnostics->capacity = diagnostics->capacity * 2 + 8;
+        diagnostics->items = realloc(diagnostics->items, sizeof (Diagnostic) * diagnostics->capacity);
+    }
+    Diagnostic *diagnostic = &diagnostics->items[diagnostics->count++];
+    diagnostic->error = error;
+    diagnostic->node = node;
+}
+
+// Resolves the variables of the expression under node, left to right
+void resolveExpr(Resolver *resolver, Node *node) {
+    Ast *ast = resolver->ast;
+    WalkStack *walk = &resolver->walk;
+    int base = walk->count;
+    pushWalk(walk, node - ast->nodes, 0);
+    while (walk->count > base) {
+        node = nodeAt(ast, walk->frames[--walk->count].node);
+        if (node->type == Identifier) {
+            Binding *binding = &resolver->bindings[node->data.name.id];
+            if (binding->slot < 0) {
+                addDiagnostic(resolver->diagnostics, CompileUndefinedVariable, node);
+            } else {
+                node->data.name.slot = binding->slot;
+            }
+        } else if (node->type == BinaryOp) {
+            pushWalk(walk, node->data.binOp.rhs, 0);
+            pushWalk(walk, node->data.binOp.lhs, 0);
+        }
+    }
+}
+
+// Resolves the statements of program, with the program and every if and
+// loop body as a scope. The frame of each open scope holds how many names
+// were declared when it was entered, and the largest frame size it needed
+// so far.
+int resolveScopes(Resolver *resolver, NodeIndex program) {
+    Ast *ast = resolver->ast;
+    WalkStack *walk = &resolver->walk;
+    WalkFrame *frame = pushWalk(walk, program, 0);
+    frame->base = resolver->declaredCount;
+    int frameSize = 0;
+    while (walk->count > 0) {
+        frame = topWalk(walk);
+        Node *owner = nodeAt(ast, frame->node);
+        // Size of the frame as of the statement just resolved, counting the
+        // scope it closed if any
+        int inner = 0;
+        if (frame->next == owner->data.children.count) {
+            inner = frame->mark;
+            int base = frame->base;
+            walk->count--;
+            while (resolver->declaredCount > base) {
+                resolver->bindings[resolver->declared[--resolver->declaredCount]].slot = -1;
+            }
+            if (walk->count == 0) {
+                frameSize = inner;
+                break;
+            }
+        } else {
+            Node *node = childAt(ast, owner, frame->next++);
+            switch (node->type) {
+                case VarAssign:
+                    {
+                        resolveExpr(resolver, childAt(ast, node, 2));
+                        Symbol type = childAt(ast, node, 0)->data.name.id;
+                        Node *name = childAt(ast, node, 1);
+                        Binding *binding = &resolver->bindings[name->data.name.id];
+                        if (binding->slot < 0) {
+                            binding->slot = resolver->declaredCount;
+                            binding->type = type;
+                            resolver->declared[resolver->declaredCount++] = name->data.name.id;
+                        } else if (binding->type != type) {
+                            addDiagnostic(resolver->diagnostics, CompileDuplicateName, node);
+                        }
+                        name->data.name.slot = binding->slot;
+                        break;
+                    }
+                case FunCall:
+                    for (uint32_t i = 1; i < node->data.children.count; i++) {
+                        resolveExpr(resolver, childAt(ast, node, i));
+                    }
+                    break;
+                case IfStatement:
+                    resolveExpr(resolver, childAt(ast, node, 0));
+                    frame = pushWalk(walk, node - ast->nodes, 1);
+                    frame->base = resolver->declaredCount;
+                    continue;
+                case LoopStatement:
+                    frame = pushWalk(walk, node - ast->nodes, 0);
+                    frame->base = resolver->declaredCount;
+                    continue;
+                default:
+                    break;
+            }
+        }
+        frame = topWalk(walk);
+        int size = resolver->declaredCount - frame->base + inner;
+        if (size > frame->mark) {
+            frame->mark = size;
+        }
+    }
+    return frameSize;
+}
+
+// Annotates the identifiers of program with frame slots and returns the
+// frame size of the program. Every undefined name and conflicting
+// declaration is added to diagnostics.
+int resolveProgram(Interner *interner, Ast *ast, NodeIndex program, Diagnostics *diagnostics) {
+    Resolver resolver;
+    resolver.ast = ast;
+    resolver.bindings = malloc(sizeof (Binding) * interner->count);
+    for (int i = 0; i < interner->count; i++) {
+        resolver.bindings[i].slot = -1;
+    }
+    resolver.declared = malloc(sizeof (Symbol) * interner->count);
+    resolver.declaredCount = 0;
+    resolver.diagnostics = diagnostics;
+    initWalkStack(&resolver.walk);
+    int frameSize = resolveScopes(&resolver, program);
+    freeWalkStack(&resolver.walk);
+    free(resolver.bindings);
+    free(resolver.declared);
+    return frameSize;
+}
+
+typedef enum _ValueType {
+    UnsetValue,
+    IntValue,
+    StrValue,
+} ValueType;
+
+// Static types between resolution and the back ends. Every expression
+// node gets its ValueType: a literal its own, a variable the type it was
+// declared with, + of two strs is a str, == compares two ints or two strs,
+// and every other operator takes and gives ints. A mismatch is reported
+// where it is found and leaves the expression UnsetValue, which is not
+// reported again further up.
+typedef struct _Checker {
+    Ast *ast;
+    Symbol printSymbol;
+    Symbol intSymbol;
+    Symbol strSymbol;
+    // Type of the variable in each slot as of the statement being checked.
+    // Declarations never change the type of a visible variable, so this is
+    // only news when a slot is reused.
+    ValueType *slotTypes;
+    Diagnostics *diagnostics;
+    WalkStack walk;
+} Checker;
+
+// Types the expression under node from the leaves up
+ValueType checkExpr(Checker *checker, Node *node) {
+    Ast *ast = checker->ast;
+    WalkStack *walk = &checker->walk;
+    int base = walk->count;
+    Node *root = node;
+    pushWalk(walk, node - ast->nodes, 0);
+    while (walk->count > base) {
+        WalkFrame *frame = topWalk(walk);
+        node = nodeAt(ast, frame->node);
+        if (node->type == BinaryOp && frame->next < 2) {
+            pushWalk(walk, childIndex(ast, node, frame->next++), 0);
+            continue;
+        }
+        walk->count--;
+        ValueType type = UnsetValue;
+        switch (node->type) {
+            case IntLiteral:
+                type = IntValue;
+                break;
+            case StrLiteral:
+                type = StrValue;
+                break;
+            case Identifier:
+                type = checker->slotTypes[node->data.name.slot];
+                break;
+            case BinaryOp:
+                {
+                    ValueType lhs = nodeAt(ast, node->data.binOp.lhs)->valueType;
+                    ValueType rhs = nodeAt(ast, node->data.binOp.rhs)->valueType;
+                    if (lhs == UnsetValue || rhs == UnsetValue) {
+                        break;
+                    }
+                    if (lhs != rhs) {
+                        addDiagnostic(checker->diagnostics, CompileTypeMismatch, node);
+                    } else if (lhs == IntValue || node->op == EqualOp) {
+                        type = IntValue;
+                    } else if (node->op == AddOp) {
+                        type = StrValue;
+                    } else {
+                        addDiagnostic(checker->diagnostics, CompileUnsupported, node);
+                    }
+                    break;
+                }
+            default:
+                addDiagnostic(checker->diagnostics, CompileNoValue, node);
+                break;
+        }
+        node->valueType = type;
+    }
+    return root->valueType;
+}
+
+// Checks one statement, pushing the body of an if or loop onto the walk
+// stack for checkStatements to go through
+void checkStatement(Checker *checker, Node *node) {
+    Ast *ast = checker->ast;
+    switch (node->type) {
+        case VarAssign:
+            {
+                Node *varType = childAt(ast, node, 0);
+                Node *value = childAt(ast, node, 2);
+                ValueType type = checkExpr(checker, value);
+                ValueType declared = UnsetValue;
+                if (varType->data.name.id == checker->intSymbol) {
+                    declared = IntValue;
+                } else if (varType->data.name.id == checker->strSymbol) {
+                    declared = StrValue;
+                } else {
+                    addDiagnostic(checker->diagnostics, CompileUnknownType, varType);
+                }
+                if (declared != UnsetValue && type != UnsetValue && type != declared) {
+                    addDiagnostic(checker->diagnostics, CompileTypeMismatch, value);
+                }
+                checker->slotTypes[childAt(ast, node, 1)->data.name.slot] = declared;
+                break;
+            }
+        case FunCall:
+            if (childAt(ast, node, 0)->data.name.id != checker->printSymbol) {
+                addDiagnostic(checker->diagnostics, CompileUnknownFunction, childAt(ast, node, 0));
+            }
+            for (uint32_t i = 1; i < node->data.children.count; i++) {
+                checkExpr(checker, childAt(ast, node, i));
+            }
+            break;
+        case IfStatement:
+            {
+                Node *cond = childAt(ast, node, 0);
+                if (checkExpr(checker, cond) == StrValue) {
+                    addDiagnostic(checker->diagnostics, CompileTypeMismatch, cond);
+                }
+                pushWalk(&checker->walk, node - ast->nodes, 1);
+                break;
+            }
+        case LoopStatement:
+            pushWalk(&checker->walk, node - ast->nodes, 0);
+            break;
+        default:
+            break;
+    }
+}
+
+void checkStatements(Checker *checker, NodeIndex program) {
+    WalkStack *walk = &checker->walk;
+    pushWalk(walk, program, 0);
+    while (walk->count > 0) {
+        WalkFrame *frame = topWalk(walk);
+        Node *owner = nodeAt(checker->ast, frame->node);
+        if (frame->next == owner->data.children.count) {
+            walk->count--;
+        } else {
+            checkStatement(checker, childAt(checker->ast, owner, frame->next++));
+        }
+    }
+}
+
+// Gives every expression of a resolved program its type, adding the
+// mismatches to diagnostics
+void checkProgram(Interner *interner, Ast *ast, NodeIndex program, int frameSize, Diagnostics *diagnostics) {
+    Checker checker;
+    checker.ast = ast;
+    checker.printSymbol = intern(interner, "print", 5);
+    checker.intSymbol = intern(interner, "int", 3);
+    checker.strSymbol = intern(interner, "str", 3);
+    checker.slotTypes = calloc(frameSize + 1, sizeof (ValueType));
+    checker.diagnostics = diagnostics;
+    initWalkStack(&checker.walk);
+    checkStatements(&checker, program);
+    freeWalkStack(&checker.walk);
+    free(checker.slotTypes);
+}
+
+// Variables live in the frame slots resolveProgram gave them
+typedef struct _Compiler {
+    Interner *interner;
+    TokenArray *tokens;
+    Ast *ast;
+    int lineHint;
+    Bytecode *bytecode;
+    Symbol printSymbol;
+    int depth;
+    int *breaks;
+    int breakCount;
+    int breakCapacity;
+    int loopDepth;
+    Node *errorNode;
+    WalkStack walk;
+} Compiler;
+
+void initBytecode(Bytecode *bytecode) {
+    bytecode->capacity = 256;
+    bytecode->count = 0;
+    bytecode->code = malloc(sizeof (int32_t) * bytecode->capacity);
+    bytecode->lines = malloc(sizeof (int) * bytecode->capacity);
+    bytecode->slotCount = 0;
+    bytecode->maxStack = 0;
+}
+
+void freeBytecode(Bytecode *bytecode) {
+    free(bytecode->code);
+    free(bytecode->lines);
+    freeStringPool(&bytecode->constants);
+}
+
+// Appends one word and returns its index, for patching jumps later
+int emitWord(Bytecode *bytecode, int32_t word, int line) {
+    if (bytecode->count == bytecode->capacity) {
+        bytecode->capacity *= 2;
+        bytecode->code = realloc(bytecode->code, sizeof (int32_t) * bytecode->capacity);
+        bytecode->lines = realloc(bytecode->lines, sizeof (int) * bytecode->capacity);
+    }
+    bytecode->code[bytecode->count] = word;
+    bytecode->lines[bytecode->count] = line;
+    return bytecode->count++;
+}
+
+// Emits an instruction that changes the stack depth by stackEffect
+void emitOp(Compiler *compiler, OpCode op, int stackEffect, Node *node) {
+    emitWord(compiler->bytecode, op, lineOfOffsetNear(compiler->tokens, node->start, &compiler->lineHint));
+    compiler->depth += stackEffect;
+    if (compiler->depth > compiler->bytecode->maxStack) {
+        compiler->bytecode->maxStack = compiler->depth;
+    }
+}
+
+void emitOperand(Compiler *compiler, int32_t operand) {
+    emitWord(compiler->bytecode, operand, 0);
+}
+
+// Emits the expression under node in postfix order, which is the order
+// the operators are left on the walk stack in
+CompileError compileExpr(Compiler *compiler, Node *node) {
+    Ast *ast = compiler->ast;
+    WalkStack *walk = &compiler->walk;
+    int base = walk->count;
+    pushWalk(walk, node - ast->nodes, 0);
+    while (walk->count > base) {
+        WalkFrame *frame = topWalk(walk);
+        node = nodeAt(ast, frame->node);
+        if (node->type == BinaryOp && frame->next < 2) {
+            pushWalk(walk, childIndex(ast, node, frame->next++), 0);
+            continue;
+        }
+        walk->count--;
+        switch (node->type) {
+            case IntLiteral:
+                emitOp(compiler, OpPushInt, 1, node);
+                emitOperand(compiler, node->data.val);
+                break;
+            case StrLiteral:
+                emitOp(compiler, OpPushStr, 1, node);
+                emitOperand(compiler, poolString(&compiler->bytecode->constants, compiler->interner, node->data.str));
+                break;
+            case Identifier:
+                emitOp(compiler, OpLoad, 1, node);
+                emitOperand(compiler, node->data.name.slot);
+                break;
+            case BinaryOp:
+                {
+                    OpCode op = binaryOpCodes[node->op];
+                    if (nodeAt(ast, node->data.binOp.lhs)->valueType == StrValue) {
+                        op = node->op == AddOp ? OpConcat : OpEqualStr;
+                    }
+                    emitOp(compiler, op, -1, node);
+                    break;
+                }
+            default:
+                walk->count = base;
+                compiler->errorNode = node;
+                return CompileNoValue;
+        }
+    }
+    return CompileSuccess;
+}
+
+// Compiles one statement. The body of an if or loop is pushed onto the
+// walk stack, with where its jump is to be patched or where the loop
+// starts and which of the breaks are its own, and compileStatements
+// finishes the block once its body is through.
+CompileError compileStatement(Compiler *compiler, Node *node) {
+    Bytecode *bytecode = compiler->bytecode;
+    Ast *ast = compiler->ast;
+    CompileError error = CompileSuccess;
+    switch (node->type) {
+        case VarAssign:
+            {
+                error = compileExpr(compiler, childAt(ast, node, 2));
+                if (error != CompileSuccess) {
+                    return error;
+                }
+                emitOp(compiler, OpStore, -1, node);
+                emitOperand(compiler, childAt(ast, node, 1)->data.name.slot);
+                break;
+            }
+        case FunCall:
+            {
+                if (childAt(ast, node, 0)->data.name.id != compiler->printSymbol) {
+                    compiler->errorNode = childAt(ast, node, 0);
+                    return CompileUnknownFunction;
+                }
+                int argCount = node->data.children.count - 1;
+                for (int i = 1; i <= argCount; i++) {
+                    error = compileExpr(compiler, childAt(ast, node, i));
+                    if (error != CompileSuccess) {
+                        return error;
+                    }
+                }
+                for (int i = 1; i <= argCount; i++) {
+                    int isStr = childAt(ast, node, i)->valueType == StrValue;
+                    emitOp(compiler, isStr ? OpPrintStr : OpPrintInt, 0, node);
+                    emitOperand(compiler, argCount - i + 1);
+                }
+                emitOp(compiler, OpPrintLine, -argCount, node);
+                emitOperand(compiler, argCount);
+                break;
+            }
+        case IfStatement:
+            {
+                error = compileExpr(compiler, childAt(ast, node, 0));
+                if (error != CompileSuccess) {
+                    return error;
+                }
+                emitOp(compiler, OpJumpIfFalse, -1, node);
+                WalkFrame *frame = pushWalk(&compiler->walk, node - ast->nodes, 1);
+                frame->mark = emitWord(bytecode, 0, 0);
+                break;
+            }
+        case LoopStatement:
+            {
+                WalkFrame *frame = pushWalk(&compiler->walk, node - ast->nodes, 0);
+                frame->mark = bytecode->count;
+                frame->base = compiler->breakCount;
+                compiler->loopDepth++;
+                break;
+            }
+        case BreakStatement:
+            {
+                if (compiler->loopDepth == 0) {
+                    compiler->errorNode = node;
+                    return CompileBreakOutsideLoop;
+                }
+                emitOp(compiler, OpJump, 0, node);
+                if (compiler->breakCount == compiler->breakCapacity) {
+                    compiler->breakCapacity *= 2;
+                    compiler->breaks = realloc(compiler->breaks, sizeof (int) * compiler->breakCapacity);
+                }
+                compiler->breaks[compiler->breakCount++] = emitWord(bytecode, 0, 0);
+                break;
+            }
+        default:
+            compiler->errorNode = node;
+            return CompileNoValue;
+    }
+    return error;
+}
+
+// Compiles the children of owner from the first one on as statements
+CompileError compileStatements(Compiler *compiler, NodeIndex program) {
+    Bytecode *bytecode = compiler->bytecode;
+    WalkStack *walk = &compiler->walk;
+    pushWalk(walk, program, 0);
+    while (walk->count > 0) {
+        WalkFrame *frame = topWalk(walk);
+        Node *owner = nodeAt(compiler->ast, frame->node);
+        if (frame->next < owner->data.children.count) {
+            CompileError error = compileStatement(compiler, childAt(compiler->ast, owner, frame->next++));
+            if (error != CompileSuccess) {
+                return error;
+            }
+            continue;
+        }
+        walk->count--;
+        if (owner->type == IfStatement) {
+            bytecode->code[frame->mark] = bytecode->count;
+        } else if (owner->type == LoopStatement) {
+            int start = frame->mark;
+            int firstBreak = frame->base;
+            compiler->loopDepth--;
+            emitOp(compiler, OpJump, 0, owner);
+            emitOperand(compiler, start);
+            for (int i = firstBreak; i < compiler->breakCount; i++) {
+                bytecode->code[compiler->breaks[i]] = bytecode->count;
+            }
+            compiler->breakCount = firstBreak;
+        }
+    }
+    return CompileSuccess;
+}
+
+// Lowers program, whose names have been resolved into a frame of
+// frameSize slots, to bytecode. On error *errorNode is where it was found.
+CompileError compileProgram(
+    Interner *interner,
+    TokenArray *tokens,
+    Ast *ast,
+    NodeIndex program,
+    int frameSize,
+    Bytecode *bytecode,
+    Node **errorNode
+) {
+    Compiler compiler;
+    compiler.interner = interner;
+    compiler.tokens = tokens;
+    compiler.ast = ast;
+    compiler.lineHint = 1;
+    compiler.bytecode = bytecode;
+    compiler.printSymbol = intern(interner, "print", 5);
+    compiler.depth = 0;
+    compiler.breakCapacity = 16;
+    compiler.breakCount = 0;
+    compiler.breaks = malloc(sizeof (int) * compiler.breakCapacity);
+    compiler.loopDepth = 0;
+    compiler.errorNode = NULL;
+    initBytecode(bytecode);
+    initStringPool(&bytecode->constants, interner);
+    bytecode->slotCount = frameSize;
+    initWalkStack(&compiler.walk);
+    CompileError error = compileStatements(&compiler, program);
+    emitWord(bytecode, OpHalt, 0);
+    freeWalkStack(&compiler.walk);
+    free(compiler.breaks);
+    *errorNode = compiler.errorNode;
+    return error;
+}
+
+// Which member is in use is known statically from the opcode
+typedef union _Value {
+    int64_t num;
+    Slice *str;
+} Value;
+
+typedef enum _RuntimeError {
+    RunSuccess,
+    RunDivideByZero,
+} RuntimeError;
+
+static const char *runtimeErrorMessages[] = {
+    [RunSuccess] = "success",
+    [RunDivideByZero] = "division by zero",
+};
+
+// Joined strings are made in arena and live until the run is over
+Slice *concatStrings(Arena *arena, Slice *a, Slice *b) {
+    Slice *result = arenaAlloc(arena, sizeof (Slice));
+    result->len = a->len + b->len;
+    result->chars = arenaAlloc(arena, result->len + 1);
+    memcpy(result->chars, a->chars, a->len);
+    memcpy(result->chars + a->len, b->chars, b->len);
+    result->chars[result->len] = 0;
+    return result;
+}
+
+int stringsEqual(Slice *a, Slice *b) {
+    return a->len == b->len && memcmp(a->chars, b->chars, a->len) == 0;
+}
+
+// Runs bytecode with direct threading: opcodes are first replaced by the
+// address of their handler, and every handler ends by jumping straight to
+// the next one, so there is no central switch to mispredict. Arithmetic
+// wraps around on overflow. On error *errorLine is the line of the failing
+// instruction.
+RuntimeError runBytecode(Bytecode *bytecode, FILE *out, int *errorLine) {
+    static void *const handlers[] = {
+        [OpPushInt] = &&pushInt,
+        [OpPushStr] = &&pushStr,
+        [OpLoad] = &&load,
+        [OpStore] = &&store,
+        [OpAdd] = &&add,
+        [OpSubtract] = &&subtract,
+        [OpMultiply] = &&multiply,
+        [OpDivide] = &&divide,
+        [OpEqual] = &&equal,
+        [OpLessThan] = &&lessThan,
+        [OpLessThanOrEqual] = &&lessThanOrEqual,
+        [OpGreaterThan] = &&greaterThan,
+        [OpGreaterThanOrEqual] = &&greaterThanOrEqual,
+        [OpConcat] = &&concat,
+        [OpEqualStr] = &&equalStr,
+        [OpJump] = &&jump,
+        [OpJumpIfFalse] = &&jumpIfFalse,
+        [OpPrintInt] = &&printInt,
+        [OpPrintStr] = &&printStr,
+        [OpPrintLine] = &&printLine,
+        [OpHalt] = &&halt,
+    };
+    static const int operandCounts[] = {
+        [OpPushInt] = 1, [OpPushStr] = 1, [OpLoad] = 1, [OpStore] = 1,
+        [OpJump] = 1, [OpJumpIfFalse] = 1, [OpPrintInt] = 1, [OpPrintStr] = 1,
+        [OpPrintLine] = 1, [OpHalt] = 0,
+    };
+    int count = bytecode->count;
+    void **threaded = malloc(sizeof (void *) * count);
+    for (int i = 0; i < count; ) {
+        OpCode op = bytecode->code[i];
+        threaded[i] = handlers[op];
+        for (int j = 1; j <= operandCounts[op]; j++) {
+            threaded[i + j] = (void *)(intptr_t)bytecode->code[i + j];
+        }
+        i += 1 + operandCounts[op];
+    }
+    Value *slots = malloc(sizeof (Value) * (bytecode->slotCount + 1));
+    Value *stack = malloc(sizeof (Value) * (bytecode->maxStack + 1));
+    Value *sp = stack;
+    // String values point at a Slice, and constants already has one for
+    // every literal
+    Slice *constants = bytecode->constants.strings;
+    Arena strings;
+    initArena(&strings);
+    RuntimeError result = RunSuccess;
+    void **pc = threaded;
+    void **at = pc;
+    Value *a;
+    Value *b;
+
+#define NEXT() do { at = pc; goto **pc++; } while (0)
+#define OPERAND() ((int32_t)(intptr_t)*pc++)
+#define BINARY() \
+    b = --sp; \
+    a = sp - 1;
+#define COMPARE(cmp) \
+    BINARY(); \
+    a->num = a->num cmp b->num; \
+    NEXT();
+
+    NEXT();
+pushInt:
+    sp->num = OPERAND();
+    sp++;
+    NEXT();
+pushStr:
+    sp->str = &constants[OPERAND()];
+    sp++;
+    NEXT();
+load:
+    *sp++ = slots[OPERAND()];
+    NEXT();
+store:
+    slots[OPERAND()] = *--sp;
+    NEXT();
+add:
+    BINARY();
+    a->num = (int64_t)((uint64_t)a->num + (uint64_t)b->num);
+    NEXT();
+subtract:
+    BINARY();
+    a->num = (int64_t)((uint64_t)a->num - (uint64_t)b->num);
+    NEXT();
+multiply:
+    BINARY();
+    a->num = (int64_t)((uint64_t)a->num * (uint64_t)b->num);
+    NEXT();
+divide:
+    BINARY();
+    if (b->num == 0) {
+        result = RunDivideByZero;
+        goto halt;
+    }
+    a->num = b->num == -1
+        ? (int64_t)(0 - (uint64_t)a->num)
+        : a->num / b->num;
+    NEXT();
+equal:
+    COMPARE(==);
+lessThan:
+    COMPARE(<);
+lessThanOrEqual:
+    COMPARE(<=);
+greaterThan:
+    COMPARE(>);
+greaterThanOrEqual:
+    COMPARE(>=);
+concat:
+    BINARY();
+    a->str = concatStrings(&strings, a->str, b->str);
+    NEXT();
+equalStr:
+    BINARY();
+    a->num = stringsEqual(a->str, b->str);
+    NEXT();
+jump:
+    {
+        int32_t target = OPERAND();
+        pc = threaded + target;
+    }
+    NEXT();
+jumpIfFalse:
+    {
+        int32_t target = OPERAND();
+        if ((--sp)->num == 0) {
+            pc = threaded + target;
+        }
+        NEXT();
+    }
+printInt:
+    {
+        int depth = OPERAND();
+        fprintf(out, "%" PRId64, sp[-depth].num);
+        if (depth > 1) {
+            fputc(' ', out);
+        }
+        NEXT();
+    }
+printStr:
+    {
+        int depth = OPERAND();
+        fwrite(sp[-depth].str->chars, 1, sp[-depth].str->len, out);
+        if (depth > 1) {
+            fputc(' ', out);
+        }
+        NEXT();
+    }
+printLine:
+    sp -= OPERAND();
+    fputc('\n', out);
+    NEXT();
+halt:
+#undef NEXT
+#undef OPERAND
+#undef BINARY
+#undef COMPARE
+    *errorLine = bytecode->lines[at - threaded];
+    freeArena(&strings);
+    free(stack);
+    free(slots);
+    free(threaded);
+    return result;
+}
+
+// Expression registers for the assembly backend. rax and rdx are left out
+// because idiv needs them and they carry the operands of the string
+// helpers, which save every one of these, so only caller-saved registers
+// are needed.
+#define CG_REGISTER_COUNT 7
+
+static const char *cgRegisters[CG_REGISTER_COUNT] = {
+    "%rcx", "%rsi", "%rdi", "%r8", "%r9", "%r10", "%r11",
+};
+
+static const char *cgByteRegisters[CG_REGISTER_COUNT] = {
+    "%cl", "%sil", "%dil", "%r8b", "%r9b", "%r10b", "%r11b",
+};
+
+// Condition code of each comparison, and of its negation for branching
+static const char *cgConditions[EndOfInput + 1] = {
+    [EqualOp] = "e",
+    [LessThan] = "l",
+    [LessThanOrEqual] = "le",
+    [GreaterThan] = "g",
+    [GreaterThanOrEqual] = "ge",
+};
+
+static const char *cgNegatedConditions[EndOfInput + 1] = {
+    [EqualOp] = "ne",
+    [LessThan] = "ge",
+    [LessThanOrEqual] = "g",
+    [GreaterThan] = "le",
+    [GreaterThanOrEqual] = "l",
+};
+
+static const char *cgArithmetic[EndOfInput + 1] = {
+    [AddOp] = "addq",
+    [SubtractOp] = "subq",
+    [MultiplyOp] = "imulq",
+};
+
+// Each frame slot resolveProgram handed out is 8 bytes below %rbp, and the
+// types of expressions come from checkProgram. Ints are values, strs are
+// pointers to a quad length and then the bytes: constants in .rodata, and
+// joined strings from malloc that live until the program exits.
+typedef struct _CodeGen {
+    TokenArray *tokens;
+    Interner *interner;
+    Ast *ast;
+    Buffer text;
+    StringPool strings;
+    int labelCount;
+    int slotCount;
+    Symbol printSymbol;
+    int *loopEnds;
+    int loopDepth;
+    int loopCapacity;
+    // Sethi-Ullman label + 1 of each node, or 0 when not known yet
+    int *labels;
+    Node *errorNode;
+    // Whether the shared division by zero exit and the string helpers are
+    // used, so that only those are written out
+    int divides;
+    int concats;
+    int equals;
+    WalkStack walk;
+} CodeGen;
+
+int cgNewLabel(CodeGen *cg) {
+    return cg->labelCount++;
+}
+
+int cgLabel(CodeGen *cg, Node *node);
+
+// Registers needed to evaluate node: a leaf on the right is used straight
+// from memory or as an immediate and needs none, one on the left or a
+// string constant needs one, and an operator needs one more than its children when they tie.
+int cgNeed(CodeGen *cg, Node *node, int isRight) {
+    if (node->type != BinaryOp) {
+        // A string constant has no operand form that works in a PIE
+        return isRight && node->type != StrLiteral ? 0 : 1;
+    }
+    return cgLabel(cg, node) - 1;
+}
+
+// Returns the label + 1 of the BinaryOp node, labelling the operators
+// under it that have none yet from the leaves up
+int cgLabel(CodeGen *cg, Node *node) {
+    Ast *ast = cg->ast;
+    WalkStack *walk = &cg->walk;
+    int base = walk->count;
+    int *label = &cg->labels[node - ast->nodes];
+    if (*label == 0) {
+        pushWalk(walk, node - ast->nodes, 0);
+    }
+    while (walk->count > base) {
+        WalkFrame *frame = topWalk(walk);
+        Node *op = nodeAt(ast, frame->node);
+        if (frame->next < 2) {
+            NodeIndex child = childIndex(ast, op, frame->next++);
+            if (nodeAt(ast, child)->type == BinaryOp && cg->labels[child] == 0) {
+                pushWalk(walk, child, 0);
+            }
+            continue;
+        }
+        walk->count--;
+        int left = cgNeed(cg, nodeAt(ast, op->data.binOp.lhs), 0);
+        int right = cgNeed(cg, nodeAt(ast, op->data.binOp.rhs), 1);
+        cg->labels[frame->node] = (left == right ? left + 1 : (left > right ? left : right)) + 1;
+    }
+    return *label;
+}
+
+// Writes the assembler operand for a leaf: an immediate, a frame slot or
+// the address of a string constant
+void cgLeafOperand(Node *node, char *operand, size_t size) {
+    if (node->type == IntLiteral) {
+        snprintf(operand, size, "$%d", node->data.val);
+    } else {
+        snprintf(operand, size, "-%d(%%rbp)", 8 * (node->data.name.slot + 1));
+    }
+}
+
+// Divides reg by src. Dividing by zero jumps to .Ldivzero with the line
+// in esi, and dividing by -1 negates so INT64_MIN / -1 wraps like the VM
+// rather than trapping in idiv.
+void cgDivide(CodeGen *cg, Node *node, const char *src, int reg) {
+    const char *dest = cgRegisters[reg];
+    Node *rhs = nodeAt(cg->ast, node->data.binOp.rhs);
+    int line = lineOfOffset(cg->tokens, node->start);
+    if (src[0] == '$') {
+        if (rhs->data.val == 0) {
+            cg->divides = 1;
+            bufferPrintf(&cg->text, "\tmovl $%d, %%esi\n\tjmp .Ldivzero\n", line);
+        } else if (rhs->data.val == -1) {
+            bufferPrintf(&cg->text, "\tnegq %s\n", dest);
+        } else {
+            // idiv takes no immediate, so the divisor goes through the stack
+            bufferPrintf(&cg->text, "\tmovq %s, %%rax\n\tcqto\n", dest);
+            bufferPrintf(&cg->text, "\tpushq %s\n\tidivq (%%rsp)\n\taddq $8, %%rsp\n", src);
+            bufferPrintf(&cg->text, "\tmovq %%rax, %s\n", dest);
+        }
+        return;
+    }
+    int nonZero = cgNewLabel(cg);
+    int divide = cgNewLabel(cg);
+    int end = cgNewLabel(cg);
+    cg->divides = 1;
+    bufferPrintf(&cg->text, "\tcmpq $0, %s\n\tjne .L%d\n", src, nonZero);
+    bufferPrintf(&cg->text, "\tmovl $%d, %%esi\n\tjmp .Ldivzero\n", line);
+    bufferPrintf(&cg->text, ".L%d:\n\tcmpq $-1, %s\n\tjne .L%d\n", nonZero, src, divide);
+    bufferPrintf(&cg->text, "\tnegq %s\n\tjmp .L%d\n", dest, end);
+    bufferPrintf(&cg->text, ".L%d:\n\tmovq %s, %%rax\n\tcqto\n", divide, dest);
+    bufferPrintf(&cg->text, "\tidivq %s\n\tmovq %%rax, %s\n.L%d:\n", src, dest, end);
+}
+
+// Applies the operator of node to the value in reg and src, leaving the
+// result in reg
+void cgApply(CodeGen *cg, Node *node, const char *src, int reg) {
+    const char *dest = cgRegisters[reg];
+    int op = node->op;
+    if (nodeAt(cg->ast, node->data.binOp.lhs)->valueType == StrValue) {
+        if (op == AddOp) {
+            cg->concats = 1;
+        } else {
+            cg->equals = 1;
+        }
+        bufferPrintf(&cg->text, "\tmovq %s, %%rdx\n\tmovq %s, %%rax\n", src, dest);
+        bufferPrintf(&cg->text, "\tcall %s\n", op == AddOp ? ".Lconcat" : ".Lequal");
+        bufferPrintf(&cg->text, "\tmovq %%rax, %s\n", dest);
+    } else if (op == DivideOp) {
+        cgDivide(cg, node, src, reg);
+    } else if (cgConditions[op] != NULL) {
+        bufferPrintf(&cg->text, "\tcmpq %s, %s\n", src, dest);
+        bufferPrintf(&cg->text, "\tset%s %s\n", cgConditions[op], cgByteRegisters[reg]);
+        bufferPrintf(&cg->text, "\tmovzbq %s, %s\n", cgByteRegisters[reg], dest);
+    } else {
+        bufferPrintf(&cg->text, "\t%s %s, %s\n", cgArithmetic[op], src, dest);
+    }
+}
+
+// Loads a leaf into reg
+void cgLeaf(CodeGen *cg, Node *node, int reg) {
+    if (node->type == StrLiteral) {
+        bufferPrintf(&cg->text, "\tleaq .LS%d(%%rip), %s\n",
+            poolString(&cg->strings, cg->interner, node->data.str), cgRegisters[reg]);
+        return;
+    }
+    char src[32];
+    cgLeafOperand(node, src, sizeof (src));
+    bufferPrintf(&cg->text, "\tmovq %s, %s\n", src, cgRegisters[reg]);
+}
+
+// How the operands of a BinaryOp are evaluated: a leaf rhs is used as it
+// is; otherwise the side that needs more registers goes first, and when
+// both need more than there are, the rhs is parked on the stack.
+typedef enum _CgOrder {
+    CgLeafRight,
+    CgSpillRight,
+    CgLeftFirst,
+    CgRightFirst,
+} CgOrder;
+
+CgOrder cgOrder(CodeGen *cg, Node *node, int reg) {
+    int available = CG_REGISTER_COUNT - reg;
+    int left = cgNeed(cg, nodeAt(cg->ast, node->data.binOp.lhs), 0);
+    int right = cgNeed(cg, nodeAt(cg->ast, node->data.binOp.rhs), 1);
+    if (right == 0) {
+        return CgLeafRight;
+    } else if (left >= available && right >= available) {
+        return CgSpillRight;
+    }
+    return left >= right ? CgLeftFirst : CgRightFirst;
+}
+
+// Evaluates the operands of a BinaryOp so that the lhs ends up in reg and
+// the rhs is described by src, using registers from reg up. Operators
+// below it are evaluated from the walk stack, each frame holding its
+// register and how many of its steps are done: the first operand, the
+// second, and then applying the operator.
+void cgOperands(CodeGen *cg, Node *root, int reg, char *src, size_t size, int *spilled) {
+    Ast *ast = cg->ast;
+    WalkStack *walk = &cg->walk;
+    int base = walk->count;
+    WalkFrame *frame = pushWalk(walk, root - ast->nodes, 0);
+    frame->base = reg;
+    while (1) {
+        frame = topWalk(walk);
+        Node *node = nodeAt(ast, frame->node);
+        Node *lhs = nodeAt(ast, node->data.binOp.lhs);
+        Node *rhs = nodeAt(ast, node->data.binOp.rhs);
+        reg = frame->base;
+        CgOrder order = cgOrder(cg, node, reg);
+        uint32_t step = frame->next++;
+        Node *operand = NULL;
+        int into = reg;
+        if (step == 0) {
+            operand = order == CgLeafRight || order == CgLeftFirst ? lhs : rhs;
+        } else if (step == 1) {
+            if (order == CgSpillRight) {
+                bufferPrintf(&cg->text, "\tpushq %s\n", cgRegisters[reg]);
+                operand = lhs;
+            } else if (order != CgLeafRight) {
+                operand = order == CgLeftFirst ? rhs : lhs;
+                into = reg + 1;
+            }
+        } else {
+            char operandSrc[32];
+            if (order == CgLeafRight) {
+                cgLeafOperand(rhs, operandSrc, sizeof (operandSrc));
+            } else if (order == CgSpillRight) {
+                snprintf(operandSrc, sizeof (operandSrc), "(%%rsp)");
+            } else {
+                if (order == CgRightFirst) {
+                    bufferPrintf(&cg->text, "\txchgq %s, %s\n", cgRegisters[reg], cgRegisters[reg + 1]);
+                }
+                snprintf(operandSrc, sizeof (operandSrc), "%s", cgRegisters[reg + 1]);
+            }
+            walk->count--;
+            if (walk->count == base) {
+                snprintf(src, size, "%s", operandSrc);
+                *spilled = order == CgSpillRight;
+                return;
+            }
+            cgApply(cg, node, operandSrc, reg);
+            if (order == CgSpillRight) {
+                bufferPrintf(&cg->text, "\taddq $8, %%rsp\n");
+            }
+            continue;
+        }
+        if (operand == NULL) {
+            continue;
+        }
+        if (operand->type == BinaryOp) {
+            frame = pushWalk(walk, operand - ast->nodes, 0);
+            frame->base = into;
+        } else {
+            cgLeaf(cg, operand, into);
+        }
+    }
+}
+
+// Leaves the value of node in cgRegisters[reg]
+void cgExpr(CodeGen *cg, Node *node, int reg) {
+    if (node->type != BinaryOp) {
+        cgLeaf(cg, node, reg);
+        return;
+    }
+    char src[32];
+    int spilled;
+    cgOperands(cg, node, reg, src, sizeof (src), &spilled);
+    cgApply(cg, node, src, reg);
+    if (spilled) {
+        bufferPrintf(&cg->text, "\taddq $8, %%rsp\n");
+    }
+}
+
+// Jumps to label when cond is false. An int comparison at the top is
+// turned into cmp and a conditional jump rather than a 0/1 value.
+void cgBranchIfFalse(CodeGen *cg, Node *cond, int label) {
+    if (cond->type == BinaryOp && cgConditions[cond->op] != NULL
+            && nodeAt(cg->ast, cond->data.binOp.lhs)->valueType == IntValue) {
+        char src[32];
+        int spilled;
+        cgOperands(cg, cond, 0, src, sizeof (src), &spilled);
+        bufferPrintf(&cg->text, "\tcmpq %s, %s\n", src, cgRegisters[0]);
+        if (spilled) {
+            // leaq keeps the flags from the cmp
+            bufferPrintf(&cg->text, "\tleaq 8(%%rsp), %%rsp\n");
+        }
+        bufferPrintf(&cg->text, "\tj%s .L%d\n", cgNegatedConditions[cond->op], label);
+    } else {
+        cgExpr(cg, cond, 0);
+        bufferPrintf(&cg->text, "\ttestq %s, %s\n\tje .L%d\n", cgRegisters[0], cgRegisters[0], label);
+    }
+}
+
+// Generates one statement. The body of an if or loop is pushed onto the
+// walk stack with the label of its end or start, and cgStatements closes
+// the block once its body is through.
+CompileError cgStatement(CodeGen *cg, Node *node) {
+    Ast *ast = cg->ast;
+    CompileError error = CompileSuccess;
+    switch (node->type) {
+        case VarAssign:
+            {
+                cgExpr(cg, childAt(ast, node, 2), 0);
+                bufferPrintf(&cg->text, "\tmovq %s, -%d(%%rbp)\n",
+                    cgRegisters[0], 8 * (childAt(ast, node, 1)->data.name.slot + 1));
+                break;
+            }
         case FunCall:
             {
-                printf("FunCall\n");
-                struct FunCallData *data = &(node->data.funCall);
-                printAST(data->funName, level + 1);
-                NodeList *args = data->args;
-                for (int i = 0; i < level + 1; i++) {
-                    printf("  ");
+                if (childAt(ast, node, 0)->data.name.id != cg->printSymbol) {
+                    cg->errorNode = childAt(ast, node, 0);
+                    return CompileUnknownFunction;
+                }
+                // Every argument is evaluated before anything is printed,
+                // as in the VM, so they are pushed first. An odd count is
+                // padded to keep the stack 16 byte aligned for the calls.
+                int argCount = node->data.children.count - 1;
+                int pushed = argCount + argCount % 2;
+                if (argCount % 2 != 0) {
+                    bufferPrintf(&cg->text, "\tsubq $8, %%rsp\n");
+                }
+                for (int i = 1; i <= argCount; i++) {
+                    cgExpr(cg, childAt(ast, node, i), 0);
+                    bufferPrintf(&cg->text, "\tpushq %s\n", cgRegisters[0]);
+                }
+                for (int i = 1; i <= argCount; i++) {
+                    if (i > 1) {
+                        bufferPrintf(&cg->text, "\tmovl $32, %%edi\n\tcall putchar@PLT\n");
+                    }
+                    bufferPrintf(&cg->text, "\tmovq %d(%%rsp), %%rax\n", 8 * (argCount - i));
+                    if (childAt(ast, node, i)->valueType == IntValue) {
+                        bufferPrintf(&cg->text, "\tmovq %%rax, %%rsi\n");
+                        bufferPrintf(&cg->text, "\tleaq .LFint(%%rip), %%rdi\n");
+                        bufferPrintf(&cg->text, "\txorl %%eax, %%eax\n\tcall printf@PLT\n");
+                    } else {
+                        // Strings know their length, so they are written
+                        // with fwrite rather than scanned for a NUL
+                        bufferPrintf(&cg->text, "\tleaq 8(%%rax), %%rdi\n\tmovq (%%rax), %%rdx\n");
+                        bufferPrintf(&cg->text, "\tmovl $1, %%esi\n\tmovq stdout(%%rip), %%rcx\n");
+                        bufferPrintf(&cg->text, "\tcall fwrite@PLT\n");
+                    }
+                }
+                bufferPrintf(&cg->text, "\tmovl $10, %%edi\n\tcall putchar@PLT\n");
+                if (pushed > 0) {
+                    bufferPrintf(&cg->text, "\taddq $%d, %%rsp\n", 8 * pushed);
                 }
-                printf("Args:\n");
-                while (args != NULL) {
-                    printAST(args->node, level + 2);
-                    args = args->next;
+                break;
+            }
+        case IfStatement:
+            {
+                int end = cgNewLabel(cg);
+                cgBranchIfFalse(cg, childAt(ast, node, 0), end);
+                WalkFrame *frame = pushWalk(&cg->walk, node - ast->nodes, 1);
+                frame->mark = end;
+                break;
+            }
+        case LoopStatement:
+            {
+                int start = cgNewLabel(cg);
+                int end = cgNewLabel(cg);
+                if (cg->loopDepth == cg->loopCapacity) {
+                    cg->loopCapacity *= 2;
+                    cg->loopEnds = realloc(cg->loopEnds, sizeof (int) * cg->loopCapacity);
                 }
+                cg->loopEnds[cg->loopDepth++] = end;
+                bufferPrintf(&cg->text, ".L%d:\n", start);
+                WalkFrame *frame = pushWalk(&cg->walk, node - ast->nodes, 0);
+                frame->mark = start;
                 break;
             }
-        case IntLiteral:
-            printf("IntLiteral(%d)\n", node->data.val);
+        case BreakStatement:
+            if (cg->loopDepth == 0) {
+                cg->errorNode = node;
+                return CompileBreakOutsideLoop;
+            }
+            bufferPrintf(&cg->text, "\tjmp .L%d\n", cg->loopEnds[cg->loopDepth - 1]);
+            break;
+        default:
+            cg->errorNode = node;
+            return CompileNoValue;
+    }
+    return error;
+}
+
+CompileError cgStatements(CodeGen *cg, NodeIndex program) {
+    WalkStack *walk = &cg->walk;
+    pushWalk(walk, program, 0);
+    while (walk->count > 0) {
+        WalkFrame *frame = topWalk(walk);
+        Node *owner = nodeAt(cg->ast, frame->node);
+        if (frame->next < owner->data.children.count) {
+            CompileError error = cgStatement(cg, childAt(cg->ast, owner, frame->next++));
+            if (error != CompileSuccess) {
+                return error;
+            }
+            continue;
+        }
+        walk->count--;
+        if (owner->type == IfStatement) {
+            bufferPrintf(&cg->text, ".L%d:\n", frame->mark);
+        } else if (owner->type == LoopStatement) {
+            int end = cg->loopEnds[--cg->loopDepth];
+            bufferPrintf(&cg->text, "\tjmp .L%d\n.L%d:\n", frame->mark, end);
+        }
+    }
+    return CompileSuccess;
+}
+
+// Bodies of the string helpers, which find their operands in rbx and r12
+// and leave the result in rax. Joined strings are never freed.
+static const char *cgConcatBody =
+    "\tmovq (%rbx), %r13\n\taddq (%r12), %r13\n"
+    "\tleaq 8(%r13), %rdi\n\tcall malloc@PLT\n"
+    "\tmovq %r13, (%rax)\n\tmovq %rax, %r13\n"
+    "\tleaq 8(%r13), %rdi\n\tleaq 8(%rbx), %rsi\n\tmovq (%rbx), %rdx\n\tcall memcpy@PLT\n"
+    "\tmovq (%rbx), %rdi\n\tleaq 8(%r13,%rdi), %rdi\n"
+    "\tleaq 8(%r12), %rsi\n\tmovq (%r12), %rdx\n\tcall memcpy@PLT\n"
+    "\tmovq %r13, %rax\n";
+
+static const char *cgEqualBody =
+    "\txorl %eax, %eax\n\tmovq (%rbx), %rdx\n\tcmpq (%r12), %rdx\n\tjne .Lequal_end\n"
+    "\tleaq 8(%rbx), %rdi\n\tleaq 8(%r12), %rsi\n\tcall memcmp@PLT\n"
+    "\ttestl %eax, %eax\n\tsete %al\n\tmovzbl %al, %eax\n"
+    ".Lequal_end:\n";
+
+// Writes a string helper, called with its operands in rax and rdx. It is
+// called in the middle of expressions, so it saves every expression
+// register as well as the callee-saved ones it uses, and realigns the
+// stack for libc.
+void cgHelper(Buffer *out, const char *name, const char *body) {
+    bufferPrintf(out, "%s:\n\tpushq %%rbp\n\tmovq %%rsp, %%rbp\n", name);
+    bufferPrintf(out, "\tpushq %%rbx\n\tpushq %%r12\n\tpushq %%r13\n");
+    for (int i = 0; i < CG_REGISTER_COUNT; i++) {
+        bufferPrintf(out, "\tpushq %s\n", cgRegisters[i]);
+    }
+    bufferPrintf(out, "\tandq $-16, %%rsp\n\tmovq %%rax, %%rbx\n\tmovq %%rdx, %%r12\n");
+    bufferAppend(out, body, strlen(body));
+    bufferPrintf(out, "\tleaq -%d(%%rbp), %%rsp\n", 8 * (CG_REGISTER_COUNT + 3));
+    for (int i = CG_REGISTER_COUNT - 1; i >= 0; i--) {
+        bufferPrintf(out, "\tpopq %s\n", cgRegisters[i]);
+    }
+    bufferPrintf(out, "\tpopq %%r13\n\tpopq %%r12\n\tpopq %%rbx\n\tpopq %%rbp\n\tret\n");
+}
+
+// Writes program as x86-64 AT&T assembly for gas, as a main that calls
+// printf, fwrite and putchar from libc, and string helpers next to it
+CompileError generateAssembly(
+    TokenArray *tokens,
+    Interner *interner,
+    Ast *ast,
+    NodeIndex program,
+    int frameSize,
+    Buffer *out,
+    Node **errorNode
+) {
+    CodeGen cg;
+    cg.tokens = tokens;
+    cg.interner = interner;
+    cg.ast = ast;
+    initBuffer(&cg.text);
+    initStringPool(&cg.strings, interner);
+    cg.labelCount = 0;
+    cg.printSymbol = intern(interner, "print", 5);
+    cg.slotCount = frameSize;
+    cg.loopCapacity = 16;
+    cg.loopDepth = 0;
+    cg.loopEnds = malloc(sizeof (int) * cg.loopCapacity);
+    cg.labels = calloc(ast->count, sizeof (int));
+    cg.errorNode = NULL;
+    cg.divides = 0;
+    cg.concats = 0;
+    cg.equals = 0;
+    initWalkStack(&cg.walk);
+
+    CompileError error = cgStatements(&cg, program);
+    if (error == CompileSuccess) {
+        // Resolution only lets a variable be read after it is assigned, so
+        // the frame needs no clearing
+        int frame = (8 * cg.slotCount + 15) & ~15;
+        bufferPrintf(out, "\t.section .rodata\n.LFint:\n\t.string \"%%ld\"\n");
+        if (cg.divides) {
+            bufferPrintf(out, ".LFdivzero:\n\t.string \"Runtime error: %s at line %%d\\n\"\n",
+                runtimeErrorMessages[RunDivideByZero]);
+        }
+        for (int i = 0; i < cg.strings.count; i++) {
+            Slice str = cg.strings.strings[i];
+            bufferPrintf(out, "\t.p2align 3\n.LS%d:\n\t.quad %d\n\t.ascii \"", i, str.len);
+            for (int j = 0; j < str.len; j++) {
+                unsigned char chr = str.chars[j];
+                if (chr == '"' || chr == '\\') {
+                    bufferPrintf(out, "\\%c", chr);
+                } else if (chr < ' ' || chr >= 127) {
+                    bufferPrintf(out, "\\%03o", chr);
+                } else {
+                    bufferPrintf(out, "%c", chr);
+                }
+            }
+            bufferPrintf(out, "\"\n");
+        }
+        bufferPrintf(out, "\t.text\n\t.globl main\n\t.type main, @function\nmain:\n");
+        bufferPrintf(out, "\tpushq %%rbp\n\tmovq %%rsp, %%rbp\n");
+        if (frame > 0) {
+            bufferPrintf(out, "\tsubq $%d, %%rsp\n", frame);
+        }
+        bufferAppend(out, cg.text.data, cg.text.len);
+        bufferPrintf(out, "\txorl %%eax, %%eax\n\tleave\n\tret\n");
+        if (cg.divides) {
+            // Exiting through libc flushes what was printed before. The
+            // stack may hold spilled operands, so it is realigned first.
+            bufferPrintf(out, ".Ldivzero:\n\tandq $-16, %%rsp\n\tleaq .LFdivzero(%%rip), %%rdi\n");
+            bufferPrintf(out, "\txorl %%eax, %%eax\n\tcall printf@PLT\n");
+            bufferPrintf(out, "\tmovl $1, %%edi\n\tcall exit@PLT\n");
+        }
+        if (cg.concats) {
+            cgHelper(out, ".Lconcat", cgConcatBody);
+        }
+        if (cg.equals) {
+            cgHelper(out, ".Lequal", cgEqualBody);
+        }
+        bufferPrintf(out, "\t.size main, .-main\n\t.section .note.GNU-stack,\"\",@progbits\n");
+    }
+    free(cg.text.data);
+    freeStringPool(&cg.strings);
+    free(cg.loopEnds);
+    free(cg.labels);
+    freeWalkStack(&cg.walk);
+    *errorNode = cg.errorNode;
+    return error;
+}
+
+// The JIT turns the same checked and optimized tree the assembly backend
+// reads straight into x86-64 machine code. Generated code is called as
+// int f(int64_t *slots, JitRuntime *runtime): slots stay in rbx and the
+// runtime in r12, expressions are evaluated into rax with rcx holding the
+// right operand, and printing and string work call back into C. It returns
+// 0, or the line of a division by zero.
+typedef struct _JitRuntime {
+    FILE *out;
+    Arena strings;
+} JitRuntime;
+
+typedef int (*JitFunction)(int64_t *slots, JitRuntime *runtime);
+
+void jitPrintInt(JitRuntime *runtime, int64_t value, int separator) {
+    fprintf(runtime->out, "%" PRId64, value);
+    fputc(separator, runtime->out);
+}
+
+void jitPrintStr(JitRuntime *runtime, Slice *str, int separator) {
+    fwrite(str->chars, 1, str->len, runtime->out);
+    fputc(separator, runtime->out);
+}
+
+void jitPrintLine(JitRuntime *runtime) {
+    fputc('\n', runtime->out);
+}
+
+Slice *jitConcat(JitRuntime *runtime, Slice *a, Slice *b) {
+    return concatStrings(&runtime->strings, a, b);
+}
+
+typedef struct _Jit {
+    TokenArray *tokens;
+    Interner *interner;
+    Ast *ast;
+    Buffer code;
+    StringPool *strings;
+    // Offsets of the imm64 of string loads, which hold a pool index until
+    // the pool is complete and its addresses are final
+    int *fixups;
+    int fixupCount;
+    int fixupCapacity;
+    Symbol printSymbol;
+    // 8 byte words pushed since the frame was 16 byte aligned
+    int depth;
+    // Offset of the shared epilogue
+    int exit;
+    // Offsets of the rel32 of break jumps still to be patched
+    int *breaks;
+    int breakCount;
+    int breakCapacity;
+    int loopDepth;
+    Node *errorNode;
+    WalkStack walk;
+} Jit;
+
+// Registers values are kept in, as numbered in ModRM
+#define JIT_RAX 0
+#define JIT_RCX 1
+
+// Condition codes of the comparisons, as in jcc 0x0f 0x80+cc and setcc
+// 0x0f 0x90+cc. Flipping the low bit negates a condition.
+static const uint8_t jitConditions[EndOfInput + 1] = {
+    [EqualOp] = 0x4,
+    [LessThan] = 0xc,
+    [LessThanOrEqual] = 0xe,
+    [GreaterThan] = 0xf,
+    [GreaterThanOrEqual] = 0xd,
+};
+
+void jitEmit(Jit *jit, const void *bytes, size_t len) {
+    bufferAppend(&jit->code, bytes, len);
+}
+
+void jitEmit32(Jit *jit, int32_t value) {
+    bufferAppend(&jit->code, (char *)&value, sizeof (value));
+}
+
+void jitEmit64(Jit *jit, int64_t value) {
+    bufferAppend(&jit->code, (char *)&value, sizeof (value));
+}
+
+// Emits a jump with an unknown target and returns where its rel32 is
+int jitJumpForward(Jit *jit, const void *op, size_t len) {
+    jitEmit(jit, op, len);
+    int at = jit->code.len;
+    jitEmit32(jit, 0);
+    return at;
+}
+
+// Points the rel32 at offset at to the current end of the code
+void jitPatch(Jit *jit, int at) {
+    int32_t rel = jit->code.len - (at + 4);
+    memcpy(jit->code.data + at, &rel, sizeof (rel));
+}
+
+void jitJumpBack(Jit *jit, const void *op, size_t len, int target) {
+    jitEmit(jit, op, len);
+    jitEmit32(jit, target - ((int)jit->code.len + 4));
+}
+
+// Calls a C function with the stack 16 byte aligned, as the ABI wants
+void jitCall(Jit *jit, void *function) {
+    if (jit->depth % 2 != 0) {
+        jitEmit(jit, "\x48\x83\xec\x08", 4);  // sub rsp, 8
+    }
+    jitEmit(jit, "\x49\xbb", 2);  // mov r11, imm64
+    jitEmit64(jit, (int64_t)(intptr_t)function);
+    jitEmit(jit, "\x41\xff\xd3", 3);  // call r11
+    if (jit->depth % 2 != 0) {
+        jitEmit(jit, "\x48\x83\xc4\x08", 4);  // add rsp, 8
+    }
+}
+
+// Loads a leaf into reg: an immediate, a frame slot or a string constant
+void jitLoad(Jit *jit, Node *node, int reg) {
+    if (node->type == IntLiteral) {
+        unsigned char op[] = {0x48, 0xc7, 0xc0 | reg};  // mov reg, imm32
+        jitEmit(jit, op, sizeof (op));
+        jitEmit32(jit, node->data.val);
+    } else if (node->type == StrLiteral) {
+        unsigned char op[] = {0x48, 0xb8 | reg};  // mov reg, imm64
+        jitEmit(jit, op, sizeof (op));
+        if (jit->fixupCount == jit->fixupCapacity) {
+            jit->fixupCapacity *= 2;
+            jit->fixups = realloc(jit->fixups, sizeof (int) * jit->fixupCapacity);
+        }
+        jit->fixups[jit->fixupCount++] = jit->code.len;
+        jitEmit64(jit, poolString(jit->strings, jit->interner, node->data.str));
+    } else {
+        unsigned char op[] = {0x48, 0x8b, 0x83 | reg << 3};  // mov reg, [rbx + disp32]
+        jitEmit(jit, op, sizeof (op));
+        jitEmit32(jit, 8 * node->data.name.slot);
+    }
+}
+
+// Applies the operator of node to rax and rcx, leaving the result in rax
+void jitApply(Jit *jit, Node *node) {
+    if (nodeAt(jit->ast, node->data.binOp.lhs)->valueType == StrValue) {
+        if (node->op == AddOp) {
+            jitEmit(jit, "\x4c\x89\xe7", 3);  // mov rdi, r12
+            jitEmit(jit, "\x48\x89\xc6", 3);  // mov rsi, rax
+            jitEmit(jit, "\x48\x89\xca", 3);  // mov rdx, rcx
+            jitCall(jit, (void *)jitConcat);
+        } else {
+            jitEmit(jit, "\x48\x89\xc7", 3);  // mov rdi, rax
+            jitEmit(jit, "\x48\x89\xce", 3);  // mov rsi, rcx
+            jitCall(jit, (void *)stringsEqual);
+            jitEmit(jit, "\x89\xc0", 2);  // mov eax, eax
+        }
+        return;
+    }
+    switch (node->op) {
+        case AddOp:
+            jitEmit(jit, "\x48\x01\xc8", 3);  // add rax, rcx
             break;
-        case StrLiteral:
-            printf("StrLiteral(%s)\n", node->data.str);
+        case SubtractOp:
+            jitEmit(jit, "\x48\x29\xc8", 3);  // sub rax, rcx
             break;
-        case Identifier:
-            printf("Identifier(%s)\n", node->data.id);
+        case MultiplyOp:
+            jitEmit(jit, "\x48\x0f\xaf\xc1", 4);  // imul rax, rcx
             break;
-        case TypeIdentifier:
-            printf("TypeIdentifier(%s)\n", node->data.id);
+        case DivideOp:
+            // Dividing by zero leaves through the epilogue with the line,
+            // and dividing by -1 negates so INT64_MIN / -1 wraps like the VM
+            jitEmit(jit, "\x48\x85\xc9", 3);  // test rcx, rcx
+            jitEmit(jit, "\x75\x0a", 2);  // jne +10
+            jitEmit(jit, "\xb8", 1);  // mov eax, imm32
+            jitEmit32(jit, lineOfOffset(jit->tokens, node->start));
+            jitJumpBack(jit, "\xe9", 1, jit->exit);  // jmp exit
+            jitEmit(jit, "\x48\x83\xf9\xff", 4);  // cmp rcx, -1
+            jitEmit(jit, "\x75\x05", 2);  // jne +5
+            jitEmit(jit, "\x48\xf7\xd8", 3);  // neg rax
+            jitEmit(jit, "\xeb\x05", 2);  // jmp +5
+            jitEmit(jit, "\x48\x99", 2);  // cqo
+            jitEmit(jit, "\x48\xf7\xf9", 3);  // idiv rcx
             break;
-        case BinaryOp:
-            printf("BinaryOp");
-            switch (node->data.binOp.op) {
-                case AddOp:
-                    printf("(+)");
-                    break;
-                case SubtractOp:
-                    printf("(-)");
-                    break;
-                case DivideOp:
-                    printf("(/)");
-                    break;
-                case MultiplyOp:
-                    printf("(*)");
-                    break;
-                case EqualOp:
-                    printf("(==)");
-                    break;
-                case GreaterThan:
-                    printf("(>)");
-                    break;
-                case GreaterThanOrEqual:
-                    printf("(>=)");
-                    break;
-                case LessThan:
-                    printf("(<)");
-                    break;
-                case LessThanOrEqual:
-                    printf("(<=)");
-                    break;
-                default:
-                    printf("(?)");
-                    break;
+        default:
+            {
+                unsigned char set[] = {0x0f, 0x90 | jitConditions[node->op], 0xc0};
+                jitEmit(jit, "\x48\x39\xc8", 3);  // cmp rax, rcx
+                jitEmit(jit, set, sizeof (set));  // setcc al
+                jitEmit(jit, "\x0f\xb6\xc0", 3);  // movzx eax, al
+                break;
             }
-            printf("\n");
-            printAST(node->data.binOp.lhs, level + 1);
-            printAST(node->data.binOp.rhs, level + 1);
-            break;
-        case Program:
-            printf("Program\n");
-            NodeList *statements = node->data.program.statements;
-            while (statements != NULL) {
-                printAST(statements->node, level + 2);
-                statements = statements->next;
+    }
+}
+
+// Leaves the lhs of a BinaryOp in rax and its rhs in rcx. The stack is
+// only used when both sides are operators themselves. Operators below it
+// are evaluated from the walk stack, each frame holding how many of its
+// steps are done: the first operand, the second, and then applying the
+// operator.
+void jitOperands(Jit *jit, Node *root) {
+    Ast *ast = jit->ast;
+    WalkStack *walk = &jit->walk;
+    int base = walk->count;
+    pushWalk(walk, root - ast->nodes, 0);
+    while (1) {
+        WalkFrame *frame = topWalk(walk);
+        Node *node = nodeAt(ast, frame->node);
+        Node *lhs = nodeAt(ast, node->data.binOp.lhs);
+        Node *rhs = nodeAt(ast, node->data.binOp.rhs);
+        uint32_t step = frame->next++;
+        Node *operand = NULL;
+        if (step == 0) {
+            operand = rhs->type != BinaryOp ? lhs : rhs;
+        } else if (step == 1) {
+            if (rhs->type != BinaryOp) {
+                jitLoad(jit, rhs, JIT_RCX);
+            } else if (lhs->type != BinaryOp) {
+                jitEmit(jit, "\x48\x89\xc1", 3);  // mov rcx, rax
+                jitLoad(jit, lhs, JIT_RAX);
+            } else {
+                jitEmit(jit, "\x50", 1);  // push rax
+                jit->depth++;
+                operand = lhs;
+            }
+        } else {
+            if (lhs->type == BinaryOp && rhs->type == BinaryOp) {
+                jitEmit(jit, "\x59", 1);  // pop rcx
+                jit->depth--;
+            }
+            walk->count--;
+            if (walk->count == base) {
+                return;
             }
+            jitApply(jit, node);
+            continue;
+        }
+        if (operand == NULL) {
+            continue;
+        }
+        if (operand->type == BinaryOp) {
+            pushWalk(walk, operand - ast->nodes, 0);
+        } else {
+            jitLoad(jit, operand, JIT_RAX);
+        }
+    }
+}
+
+// Leaves the value of node in rax
+void jitExpr(Jit *jit, Node *node) {
+    if (node->type != BinaryOp) {
+        jitLoad(jit, node, JIT_RAX);
+        return;
+    }
+    jitOperands(jit, node);
+    jitApply(jit, node);
+}
+
+// Jumps when cond is false and returns where the rel32 of the jump is. An
+// int comparison at the top becomes cmp and jcc rather than a 0/1 value.
+int jitBranchIfFalse(Jit *jit, Node *cond) {
+    if (cond->type == BinaryOp && cgConditions[cond->op] != NULL
+            && nodeAt(jit->ast, cond->data.binOp.lhs)->valueType == IntValue) {
+        unsigned char jump[] = {0x0f, 0x80 | (jitConditions[cond->op] ^ 1)};
+        jitOperands(jit, cond);
+        jitEmit(jit, "\x48\x39\xc8", 3);  // cmp rax, rcx
+        return jitJumpForward(jit, jump, sizeof (jump));
+    }
+    jitExpr(jit, cond);
+    jitEmit(jit, "\x48\x85\xc0", 3);  // test rax, rax
+    return jitJumpForward(jit, "\x0f\x84", 2);  // je
+}
+
+// Emits one statement. The body of an if or loop is pushed onto the walk
+// stack with where its jump is to be patched or where the loop starts and
+// which of the breaks are its own, and jitStatements closes the block once
+// its body is through.
+CompileError jitStatement(Jit *jit, Node *node) {
+    Ast *ast = jit->ast;
+    CompileError error = CompileSuccess;
+    switch (node->type) {
+        case VarAssign:
+            jitExpr(jit, childAt(ast, node, 2));
+            jitEmit(jit, "\x48\x89\x83", 3);  // mov [rbx + disp32], rax
+            jitEmit32(jit, 8 * childAt(ast, node, 1)->data.name.slot);
             break;
+        case FunCall:
+            {
+                if (childAt(ast, node, 0)->data.name.id != jit->printSymbol) {
+                    jit->errorNode = childAt(ast, node, 0);
+                    return CompileUnknownFunction;
+                }
+                // Every argument is evaluated before anything is printed,
+                // as in the VM, so they are pushed first
+                int argCount = node->data.children.count - 1;
+                for (int i = 1; i <= argCount; i++) {
+                    jitExpr(jit, childAt(ast, node, i));
+                    jitEmit(jit, "\x50", 1);  // push rax
+                    jit->depth++;
+                }
+                for (int i = 1; i <= argCount; i++) {
+                    int isStr = childAt(ast, node, i)->valueType == StrValue;
+                    jitEmit(jit, "\x4c\x89\xe7", 3);  // mov rdi, r12
+                    jitEmit(jit, "\x48\x8b\xb4\x24", 4);  // mov rsi, [rsp + disp32]
+                    jitEmit32(jit, 8 * (argCount - i));
+                    jitEmit(jit, "\xba", 1);  // mov edx, imm32
+                    jitEmit32(jit, i < argCount ? ' ' : '\n');
+                    jitCall(jit, isStr ? (void *)jitPrintStr : (void *)jitPrintInt);
+                }
+                if (argCount == 0) {
+                    jitEmit(jit, "\x4c\x89\xe7", 3);  // mov rdi, r12
+                    jitCall(jit, (void *)jitPrintLine);
+                } else {
+                    jitEmit(jit, "\x48\x81\xc4", 3);  // add rsp, imm32
+                    jitEmit32(jit, 8 * argCount);
+                    jit->depth -= argCount;
+                }
+                break;
+            }
         case IfStatement:
-            printf("IfStatement\n");
-            printAST(node->data.ifStatement.cond, level + 2);
-            NodeList *consequent = node->data.ifStatement.consequent;
-            while (consequent != NULL) {
-                printAST(consequent->node, level + 2);
-                consequent = consequent->next;
+            {
+                int jump = jitBranchIfFalse(jit, childAt(ast, node, 0));
+                WalkFrame *frame = pushWalk(&jit->walk, node - ast->nodes, 1);
+                frame->mark = jump;
+                break;
             }
-            break;
         case LoopStatement:
-            printf("LoopStatement\n");
-            NodeList *body = node->data.loopStatement.body;
-            while (body != NULL) {
-                printAST(body->node, level + 2);
-                body = body->next;
+            {
+                WalkFrame *frame = pushWalk(&jit->walk, node - ast->nodes, 0);
+                frame->mark = jit->code.len;
+                frame->base = jit->breakCount;
+                jit->loopDepth++;
+                break;
             }
-            break;
         case BreakStatement:
-            printf("BreakStatement\n");
+            if (jit->loopDepth == 0) {
+                jit->errorNode = node;
+                return CompileBreakOutsideLoop;
+            }
+            if (jit->breakCount == jit->breakCapacity) {
+                jit->breakCapacity *= 2;
+                jit->breaks = realloc(jit->breaks, sizeof (int) * jit->breakCapacity);
+            }
+            jit->breaks[jit->breakCount++] = jitJumpForward(jit, "\xe9", 1);  // jmp
             break;
+        default:
+            jit->errorNode = node;
+            return CompileNoValue;
+    }
+    return error;
+}
+
+CompileError jitStatements(Jit *jit, NodeIndex program) {
+    WalkStack *walk = &jit->walk;
+    pushWalk(walk, program, 0);
+    while (walk->count > 0) {
+        WalkFrame *frame = topWalk(walk);
+        Node *owner = nodeAt(jit->ast, frame->node);
+        if (frame->next < owner->data.children.count) {
+            CompileError error = jitStatement(jit, childAt(jit->ast, owner, frame->next++));
+            if (error != CompileSuccess) {
+                return error;
+            }
+            continue;
+        }
+        walk->count--;
+        if (owner->type == IfStatement) {
+            jitPatch(jit, frame->mark);
+        } else if (owner->type == LoopStatement) {
+            int firstBreak = frame->base;
+            jit->loopDepth--;
+            jitJumpBack(jit, "\xe9", 1, frame->mark);  // jmp start
+            for (int i = firstBreak; i < jit->breakCount; i++) {
+                jitPatch(jit, jit->breaks[i]);
+            }
+            jit->breakCount = firstBreak;
+        }
+    }
+    return CompileSuccess;
+}
+
+// Writes program as x86-64 machine code to code. String literals are
+// added to strings and the code points into it, so it has to outlive the
+// code and not change.
+CompileError jitProgram(
+    TokenArray *tokens,
+    Interner *interner,
+    Ast *ast,
+    NodeIndex program,
+    StringPool *strings,
+    Buffer *code,
+    Node **errorNode
+) {
+    Jit jit;
+    jit.tokens = tokens;
+    jit.interner = interner;
+    jit.ast = ast;
+    initBuffer(&jit.code);
+    jit.strings = strings;
+    jit.fixupCapacity = 16;
+    jit.fixupCount = 0;
+    jit.fixups = malloc(sizeof (int) * jit.fixupCapacity);
+    jit.printSymbol = intern(interner, "print", 5);
+    jit.depth = 0;
+    jit.breakCapacity = 16;
+    jit.breakCount = 0;
+    jit.breaks = malloc(sizeof (int) * jit.breakCapacity);
+    jit.loopDepth = 0;
+    jit.errorNode = NULL;
+
+    // Three pushes after the return address leave rsp 16 byte aligned
+    jitEmit(&jit, "\x55", 1);  // push rbp
+    jitEmit(&jit, "\x48\x89\xe5", 3);  // mov rbp, rsp
+    jitEmit(&jit, "\x53", 1);  // push rbx
+    jitEmit(&jit, "\x41\x54", 2);  // push r12
+    jitEmit(&jit, "\x48\x89\xfb", 3);  // mov rbx, rdi
+    jitEmit(&jit, "\x49\x89\xf4", 3);  // mov r12, rsi
+    jitEmit(&jit, "\xeb\x09", 2);  // jmp over the epilogue
+    // The epilogue comes first so every exit to it is a backward jump, and
+    // it restores rsp from rbp whatever is still pushed
+    jit.exit = jit.code.len;
+    jitEmit(&jit, "\x48\x8d\x65\xf0", 4);  // lea rsp, [rbp - 16]
+    jitEmit(&jit, "\x41\x5c", 2);  // pop r12
+    jitEmit(&jit, "\x5b", 1);  // pop rbx
+    jitEmit(&jit, "\x5d", 1);  // pop rbp
+    jitEmit(&jit, "\xc3", 1);  // ret
+
+    initWalkStack(&jit.walk);
+    CompileError error = jitStatements(&jit, program);
+    freeWalkStack(&jit.walk);
+    jitEmit(&jit, "\x31\xc0", 2);  // xor eax, eax
+    jitJumpBack(&jit, "\xe9", 1, jit.exit);  // jmp exit
+    for (int i = 0; i < jit.fixupCount; i++) {
+        int64_t index;
+        memcpy(&index, jit.code.data + jit.fixups[i], sizeof (index));
+        int64_t address = (int64_t)(intptr_t)&strings->strings[index];
+        memcpy(jit.code.data + jit.fixups[i], &address, sizeof (address));
+    }
+    free(jit.fixups);
+    free(jit.breaks);
+    *code = jit.code;
+    *errorNode = jit.errorNode;
+    return error;
+}
+
+// Copies code into fresh pages and makes them executable instead of
+// writable. Returns NULL when the pages cannot be had.
+JitFunction loadJitCode(Buffer *code) {
+    void *memory = mmap(NULL, code->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(memory, code->data, code->len);
+    if (mprotect(memory, code->len, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, code->len);
+        return NULL;
+    }
+    return (JitFunction)memory;
+}
+
+RuntimeError runJitCode(JitFunction function, int frameSize, FILE *out, int *errorLine) {
+    JitRuntime runtime;
+    runtime.out = out;
+    initArena(&runtime.strings);
+    int64_t *slots = malloc(sizeof (int64_t) * (frameSize + 1));
+    *errorLine = function(slots, &runtime);
+    free(slots);
+    freeArena(&runtime.strings);
+    return *errorLine == 0 ? RunSuccess : RunDivideByZero;
+}
+
+double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpuSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Phase helpers do nothing when stats are not being collected
+void phaseStart(Stats *stats, const char *name) {
+    if (stats == NULL || stats->phaseCount == MAX_PHASES) {
+        return;
+    }
+    PhaseStats *phase = &stats->phases[stats->phaseCount];
+    phase->name = name;
+    phase->bytes = 0;
+    phase->wallStart = nowSeconds();
+    phase->cpuStart = cpuSeconds();
+}
+
+void phaseEnd(Stats *stats, size_t bytes) {
+    if (stats == NULL || stats->phaseCount == MAX_PHASES) {
+        return;
+    }
+    PhaseStats *phase = &stats->phases[stats->phaseCount++];
+    phase->wall = nowSeconds() - phase->wallStart;
+    phase->cpu = cpuSeconds() - phase->cpuStart;
+    phase->bytes = bytes;
+}
+
+size_t tokenArrayBytes(TokenArray *tokens) {
+    return (size_t)tokens->capacity *
+        (sizeof (TokenType) + sizeof (uint32_t) + sizeof (int64_t) + sizeof (int)) +
+        (size_t)tokens->lineCapacity * sizeof (int64_t);
+}
+
+size_t internerBytes(Interner *interner) {
+    return (size_t)interner->capacity * (sizeof (SymbolName) + sizeof (uint32_t)) +
+        (size_t)interner->slotCount * sizeof (Symbol) +
+        interner->chars.cap;
+}
+
+// The table goes to stderr so that stdout stays the lex or parse output
+void printStats(Stats *stats) {
+    fprintf(stderr, "%-10s %12s %12s %14s\n", "phase", "wall ms", "cpu ms", "bytes");
+    for (int i = 0; i < stats->phaseCount; i++) {
+        PhaseStats *phase = &stats->phases[i];
+        fprintf(stderr, "%-10s %12.3f %12.3f %14zu\n",
+            phase->name, phase->wall * 1e3, phase->cpu * 1e3, phase->bytes);
+    }
+    fprintf(stderr, "tokens %d\n", stats->tokenCount);
+    int nodeCount = 0;
+    for (int type = 0; type <= BreakStatement; type++) {
+        nodeCount += stats->nodeCounts[type];
+    }
+    if (nodeCount > 0) {
+        fprintf(stderr, "nodes %d\n", nodeCount);
+    }
+    for (int type = 0; type <= BreakStatement; type++) {
+        if (stats->nodeCounts[type] > 0) {
+            fprintf(stderr, "  %-16s %10d\n", nodeTypeNames[type], stats->nodeCounts[type]);
+        }
+    }
+    if (stats->optimized) {
+        fprintf(stderr, "nodes removed by optimize %d\n", stats->removedNodes);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "peak rss %ld KB\n", usage.ru_maxrss);
+}
+
+// Prints one line of the source with its number, without the newline
+void printSourceLine(FILE *out, Source *source, TokenArray *tokens, int line) {
+    int64_t start = tokens->lineStarts[line - 1];
+    int64_t end = line < tokens->lineCount ? tokens->lineStarts[line] : (int64_t)source->len;
+    if (end > start && source->data[end - 1] == '\n') {
+        end--;
+    }
+    fprintf(out, "%*d  %.*s\n", 3, line, (int)(end - start), source->data + start);
+}
+
+// Shows where parsing stopped. The snippet comes from the source text that
+// is still in memory, found through the line starts the lexer recorded.
+void reportParseError(
+    FILE *out,
+    Source *source,
+    Interner *interner,
+    TokenArray *tokens,
+    int parseResult,
+    int posLeft
+) {
+    fprintf(out, "Parse error:\n");
+    fprintf(out, "Unexpected ");
+    int atEnd = tokens->types[posLeft] == EndOfInput;
+    if (atEnd) {
+        fprintf(out, "end of file\n");
+    } else {
+        printToken(out, interner, tokens, posLeft);
+    }
+    if (source->fd >= 0) {
+        // A streamed source is gone by now, so there is no snippet
+        if (!atEnd) {
+            fprintf(out, "at line %d, char %d\n", tokenLine(tokens, posLeft), tokenChar(tokens, posLeft));
+        }
+        return;
+    }
+    int64_t offset;
+    if (atEnd) {
+        // Point just past the last line rather than at an empty one after it
+        offset = source->len;
+        if (offset > 0 && source->data[offset - 1] == '\n') {
+            offset--;
+        }
+    } else {
+        offset = tokens->offsets[posLeft];
+    }
+    int line = lineOfOffset(tokens, offset);
+    int column = columnOfOffset(tokens, offset, line);
+    printSourceLine(out, source, tokens, line);
+    fprintf(out, "     ");
+    for (int i = 1; i < column; i++) {
+        fprintf(out, " ");
+    }
+    fprintf(out, "^\n");
+    if (!atEnd) {
+        for (int i = line + 1; i <= line + 4 && i <= tokens->lineCount; i++) {
+            if (i == tokens->lineCount && tokens->lineStarts[i - 1] == (int64_t)source->len) {
+                break;
+            }
+            printSourceLine(out, source, tokens, i);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+// The AST cache keeps the tokens, interner and tree of a parse in one file
+// named after a hash of the source. Every section is an array copied as it
+// is in memory, and the structures only ever refer to each other by index
+// or offset, so a hit maps the file and points the arrays into it with
+// nothing to re-parse or fix up. Sections start on 8-byte boundaries.
+#define CACHE_MAGIC "pipaast"
+#define CACHE_VERSION 2
+
+typedef enum _CacheSection {
+    CacheTokenTypes,
+    CacheTokenValues,
+    CacheTokenOffsets,
+    CacheTokenLengths,
+    CacheLineStarts,
+    CacheNames,
+    CacheHashes,
+    CacheSlots,
+    CacheChars,
+    CacheNodes,
+    CacheExtra,
+    CacheSectionCount,
+} CacheSection;
+
+typedef struct _CacheSectionInfo {
+    uint64_t offset;
+    uint64_t size;
+} CacheSectionInfo;
+
+// nodeSize and fingerprint guard against reading a cache written by a
+// build that lays out or numbers what is cached differently
+typedef struct _CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeSize;
+    uint64_t fingerprint;
+    uint64_t sourceHash;
+    uint64_t sourceLength;
+    int32_t parseResult;
+    int32_t posLeft;
+    int32_t tokenCount;
+    int32_t lineCount;
+    int32_t symbolCount;
+    int32_t slotCount;
+    int32_t nodeCount;
+    int32_t extraCount;
+    uint32_t program;
+    uint32_t reserved;
+    uint64_t charsLength;
+    CacheSectionInfo sections[CacheSectionCount];
+} CacheHeader;
+
+// A parse loaded from the cache. Its arrays live in the read-only mapping,
+// so they must not be grown or freed, only read until closeAstCache.
+typedef struct _AstCache {
+    void *map;
+    size_t mapLen;
+    Interner interner;
+    TokenArray tokens;
+    Ast ast;
+    NodeIndex program;
+    int parseResult;
+    int posLeft;
+} AstCache;
+
+// 64-bit hash of the source, a word at a time
+uint64_t hashSource(char *data, size_t len) {
+    const uint64_t multiplier = 0xff51afd7ed558ccdull;
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 32;
+    }
+    if (i < len) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, len - i);
+        hash = (hash ^ word) * multiplier;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Hash of what a cache's contents depend on besides CACHE_VERSION: the
+// numbering of token and node types, through the names each number has, the
+// layout of every cached struct and the hash the interner files names by.
+// Any change to these in a later build makes its caches miss.
+uint64_t cacheFingerprint() {
+    Buffer layout;
+    initBuffer(&layout);
+    for (int i = 0; i <= EndOfInput; i++) {
+        bufferPrintf(&layout, "%s,", tokenTypeNames[i]);
+    }
+    for (int i = 0; i <= BreakStatement; i++) {
+        bufferPrintf(&layout, "%s,", nodeTypeNames[i] != NULL ? nodeTypeNames[i] : "");
+    }
+    bufferPrintf(
+        &layout, "%zu %zu %zu %zu %zu %zu %zu %zu %zu %zu %zu,",
+        sizeof (Node), offsetof(Node, type), offsetof(Node, op), offsetof(Node, valueType),
+        offsetof(Node, length), offsetof(Node, data.binOp.rhs), offsetof(Node, data.children.count),
+        offsetof(Node, data.name.slot), offsetof(Node, start), sizeof (NodeIndex), sizeof (Symbol)
+    );
+    bufferPrintf(
+        &layout, "%zu %zu %zu %zu %zu %zu,",
+        sizeof (TokenType), sizeof (SymbolName), offsetof(SymbolName, len),
+        sizeof (CacheHeader), sizeof (CacheSectionInfo), (size_t)CacheSectionCount
+    );
+    bufferPrintf(&layout, "%08x", hashBytes("pipa", 4));
+    uint64_t fingerprint = hashSource(layout.data, layout.len);
+    free(layout.data);
+    return fingerprint;
+}
+
+char *astCachePath(char *cacheDir, uint64_t hash) {
+    size_t len = strlen(cacheDir) + 32;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/%016" PRIx64 ".ast", cacheDir, hash);
+    return path;
+}
+
+// Writes the cache to a temporary file that is then renamed into place, so
+// that a reader never sees half a file even when batch workers parsing the
+// same source race to save it. The cache is only ever a shortcut, so any
+// failure just leaves it unwritten.
+int saveAstCache(
+    char *cacheDir,
+    char *path,
+    uint64_t hash,
+    Source *source,
+    Interner *interner,
+    TokenArray *tokens,
+    Ast *ast,
+    NodeIndex program,
+    int parseResult,
+    int posLeft
+) {
+    CacheHeader header;
+    memset(&header, 0, sizeof (CacheHeader));
+    memcpy(header.magic, CACHE_MAGIC, sizeof (header.magic));
+    header.version = CACHE_VERSION;
+    header.nodeSize = sizeof (Node);
+    header.fingerprint = cacheFingerprint();
+    header.sourceHash = hash;
+    header.sourceLength = source->len;
+    header.parseResult = parseResult;
+    header.posLeft = posLeft;
+    header.tokenCount = tokens->count;
+    header.lineCount = tokens->lineCount;
+    header.symbolCount = interner->count;
+    header.slotCount = interner->slotCount;
+    header.nodeCount = ast->count;
+    header.extraCount = ast->extraCount;
+    header.program = program;
+    header.charsLength = interner->chars.len;
+
+    // The token types include the EndOfInput after the last token
+    void *data[CacheSectionCount] = {
+        [CacheTokenTypes] = tokens->types,
+        [CacheTokenValues] = tokens->values,
+        [CacheTokenOffsets] = tokens->offsets,
+        [CacheTokenLengths] = tokens->lengths,
+        [CacheLineStarts] = tokens->lineStarts,
+        [CacheNames] = interner->names,
+        [CacheHashes] = interner->hashes,
+        [CacheSlots] = interner->slots,
+        [CacheChars] = interner->chars.data,
+        [CacheNodes] = ast->nodes,
+        [CacheExtra] = ast->extra,
+    };
+    uint64_t sizes[CacheSectionCount] = {
+        [CacheTokenTypes] = sizeof (TokenType) * (tokens->count + 1),
+        [CacheTokenValues] = sizeof (uint32_t) * tokens->count,
+        [CacheTokenOffsets] = sizeof (int64_t) * tokens->count,
+        [CacheTokenLengths] = sizeof (int) * tokens->count,
+        [CacheLineStarts] = sizeof (int64_t) * tokens->lineCount,
+        [CacheNames] = sizeof (SymbolName) * interner->count,
+        [CacheHashes] = sizeof (uint32_t) * interner->count,
+        [CacheSlots] = sizeof (Symbol) * interner->slotCount,
+        [CacheChars] = interner->chars.len,
+        [CacheNodes] = sizeof (Node) * ast->count,
+        [CacheExtra] = sizeof (NodeIndex) * ast->extraCount,
+    };
+    uint64_t offset = sizeof (CacheHeader);
+    for (int i = 0; i < CacheSectionCount; i++) {
+        offset = (offset + 7) & ~(uint64_t)7;
+        header.sections[i].offset = offset;
+        header.sections[i].size = sizes[i];
+        offset += sizes[i];
+    }
+
+    mkdir(cacheDir, 0777);
+    size_t tempLen = strlen(path) + 8;
+    char *tempPath = malloc(tempLen);
+    snprintf(tempPath, tempLen, "%s.XXXXXX", path);
+    int fd = mkstemp(tempPath);
+    if (fd == -1) {
+        free(tempPath);
+        return -1;
+    }
+    fchmod(fd, 0644);
+    FILE *file = fdopen(fd, "wb");
+    int failed = fwrite(&header, sizeof (CacheHeader), 1, file) != 1;
+    static const char padding[8];
+    uint64_t written = sizeof (CacheHeader);
+    for (int i = 0; i < CacheSectionCount && !failed; i++) {
+        uint64_t gap = header.sections[i].offset - written;
+        failed = fwrite(padding, 1, gap, file) != gap ||
+            fwrite(data[i], 1, sizes[i], file) != sizes[i];
+        written = header.sections[i].offset + sizes[i];
+    }
+    failed |= fclose(file) != 0;
+    if (!failed) {
+        failed = rename(tempPath, path) != 0;
+    }
+    if (failed) {
+        unlink(tempPath);
+    }
+    free(tempPath);
+    return failed ? -1 : 0;
+}
+
+// Checks that every index in a mapped cache stays inside it, so that a
+// corrupt cache cannot send a reader out of bounds: the ops, symbols and
+// children of nodes, and the program. Children must come before their
+// parent, as the parser adds them, so that a walk of the tree always ends.
+// Tokens, line starts and names are only read to report an error, so they
+// are only checked for a failed parse.
+int validCacheContents(AstCache *cache, Source *source) {
+    Interner *interner = &cache->interner;
+    Ast *ast = &cache->ast;
+    for (int i = 0; i < interner->count; i++) {
+        SymbolName *name = &interner->names[i];
+        if (name->offset < 0 || name->len < 0 ||
+                (uint64_t)name->offset + name->len >= interner->chars.len) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < ast->count; i++) {
+        Node *node = &ast->nodes[i];
+        if (node->type < VarAssign || node->type > BreakStatement) {
+            return 0;
+        }
+        if (node->type == BinaryOp) {
+            if (node->op > EndOfInput || node->data.binOp.lhs >= (NodeIndex)i ||
+                    node->data.binOp.rhs >= (NodeIndex)i) {
+                return 0;
+            }
+        } else if (hasChildren(node->type)) {
+            uint64_t end = (uint64_t)node->data.children.start + node->data.children.count;
+            if (end > (uint64_t)ast->extraCount) {
+                return 0;
+            }
+            for (uint32_t j = node->data.children.start; j < end; j++) {
+                if (ast->extra[j] >= (NodeIndex)i) {
+                    return 0;
+                }
+            }
+        } else if (node->type != IntLiteral && node->type != BreakStatement &&
+                node->data.name.id >= (Symbol)interner->count) {
+            return 0;
+        }
+    }
+    if (cache->parseResult == ParseSuccess) {
+        return ast->nodes[cache->program].type == Program;
     }
+    TokenArray *tokens = &cache->tokens;
+    if (tokens->types[tokens->count] != EndOfInput || tokens->lineStarts[0] != 0) {
+        return 0;
+    }
+    for (int i = 0; i < tokens->count; i++) {
+        TokenType type = tokens->types[i];
+        if (type > EndOfInput || tokens->offsets[i] < 0 || tokens->lengths[i] < 0 ||
+                tokens->offsets[i] + tokens->lengths[i] > (int64_t)source->len ||
+                ((type == Id || type == StrLit || type == Comment) &&
+                    tokens->values[i] >= (uint32_t)interner->count)) {
+            return 0;
+        }
+    }
+    for (int i = 1; i < tokens->lineCount; i++) {
+        if (tokens->lineStarts[i] < tokens->lineStarts[i - 1] ||
+                tokens->lineStarts[i] > (int64_t)source->len) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Maps the cache for source at path. Returns -1, with nothing left mapped,
+// when there is no cache, it is for other contents or another build, or it
+// does not hold together.
+int loadAstCache(char *path, uint64_t hash, Source *source, AstCache *cache) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof (CacheHeader)) {
+        close(fd);
+        return -1;
+    }
+    cache->mapLen = st.st_size;
+    cache->map = mmap(NULL, cache->mapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cache->map == MAP_FAILED) {
+        return -1;
+    }
+    char *base = cache->map;
+    CacheHeader *header = cache->map;
+    uint64_t expected[CacheSectionCount] = {
+        [CacheTokenTypes] = sizeof (TokenType) * ((uint64_t)header->tokenCount + 1),
+        [CacheTokenValues] = sizeof (uint32_t) * (uint64_t)header->tokenCount,
+        [CacheTokenOffsets] = sizeof (int64_t) * (uint64_t)header->tokenCount,
+        [CacheTokenLengths] = sizeof (int) * (uint64_t)header->tokenCount,
+        [CacheLineStarts] = sizeof (int64_t) * (uint64_t)header->lineCount,
+        [CacheNames] = sizeof (SymbolName) * (uint64_t)header->symbolCount,
+        [CacheHashes] = sizeof (uint32_t) * (uint64_t)header->symbolCount,
+        [CacheSlots] = sizeof (Symbol) * (uint64_t)header->slotCount,
+        [CacheChars] = header->charsLength,
+        [CacheNodes] = sizeof (Node) * (uint64_t)header->nodeCount,
+        [CacheExtra] = sizeof (NodeIndex) * (uint64_t)header->extraCount,
+    };
+    int valid = memcmp(header->magic, CACHE_MAGIC, sizeof (header->magic)) == 0 &&
+        header->version == CACHE_VERSION &&
+        header->nodeSize == sizeof (Node) &&
+        header->fingerprint == cacheFingerprint() &&
+        header->sourceHash == hash &&
+        header->sourceLength == source->len &&
+        header->tokenCount >= 0 && header->lineCount > 0 &&
+        header->symbolCount >= 0 && header->slotCount >= 0 &&
+        header->nodeCount >= 0 && header->extraCount >= 0 &&
+        header->posLeft >= 0 && header->posLeft <= header->tokenCount &&
+        (header->parseResult != ParseSuccess || header->program < (uint32_t)header->nodeCount);
+    for (int i = 0; i < CacheSectionCount && valid; i++) {
+        CacheSectionInfo *section = &header->sections[i];
+        valid = section->size == expected[i] &&
+            section->offset % 8 == 0 &&
+            section->offset <= cache->mapLen &&
+            section->size <= cache->mapLen - section->offset;
+    }
+    if (!valid) {
+        munmap(cache->map, cache->mapLen);
+        return -1;
+    }
+
+    TokenArray *tokens = &cache->tokens;
+    tokens->types = (TokenType *)(base + header->sections[CacheTokenTypes].offset);
+    tokens->values = (uint32_t *)(base + header->sections[CacheTokenValues].offset);
+    tokens->offsets = (int64_t *)(base + header->sections[CacheTokenOffsets].offset);
+    tokens->lengths = (int *)(base + header->sections[CacheTokenLengths].offset);
+    tokens->count = header->tokenCount;
+    tokens->capacity = header->tokenCount;
+    tokens->allocations = 0;
+    tokens->lineStarts = (int64_t *)(base + header->sections[CacheLineStarts].offset);
+    tokens->lineCount = header->lineCount;
+    tokens->lineCapacity = header->lineCount;
+
+    Interner *interner = &cache->interner;
+    interner->names = (SymbolName *)(base + header->sections[CacheNames].offset);
+    interner->hashes = (uint32_t *)(base + header->sections[CacheHashes].offset);
+    interner->count = header->symbolCount;
+    interner->capacity = header->symbolCount;
+    interner->slots = (Symbol *)(base + header->sections[CacheSlots].offset);
+    interner->slotCount = header->slotCount;
+    interner->allocations = 0;
+    interner->chars.data = base + header->sections[CacheChars].offset;
+    interner->chars.len = header->charsLength;
+    interner->chars.cap = header->charsLength;
+
+    Ast *ast = &cache->ast;
+    ast->nodes = (Node *)(base + header->sections[CacheNodes].offset);
+    ast->count = header->nodeCount;
+    ast->capacity = header->nodeCount;
+    ast->extra = (NodeIndex *)(base + header->sections[CacheExtra].offset);
+    ast->extraCount = header->extraCount;
+    ast->extraCapacity = header->extraCount;
+    ast->scratch = NULL;
+    ast->scratchCount = 0;
+    ast->scratchCapacity = 0;
+    ast->allocations = 0;
 
+    cache->program = header->program;
+    cache->parseResult = header->parseResult;
+    cache->posLeft = header->posLeft;
+    if (!validCacheContents(cache, source)) {
+        munmap(cache->map, cache->mapLen);
+        return -1;
+    }
     return 0;
 }
 
-int opPrec(int opType) {
-  if (opType == AddOp || opType == SubtractOp) {
-    return 1;
-  } else if (opType == DivideOp || opType == MultiplyOp) {
-    return 2;
-  } else {
-    return 0;
-  }
+void closeAstCache(AstCache *cache) {
+    munmap(cache->map, cache->mapLen);
 }
 
-ParseError parseFunCall(TokenList *tokens, Node **resultNode, TokenList **tokensLeft);
-ParseError parseUnaryOp(TokenList *tokens, Node **resultNode, TokenList **tokensLeft);
-ParseError parseBinaryOp(TokenList *tokens, Node **resultNode, TokenList **tokensLeft);
-ParseError parseIfStatement(TokenList *tokens, Node** resultNode, TokenList **tokensLeft);
-ParseError parseStatements(TokenList *tokens, NodeList **statementsOut, TokenList **tokensLeft);
-ParseError parseLoopStatement(TokenList *tokens, Node **resultNode, TokenList ** tokensLeft);
-ParseError parseBreakStatement(TokenList *tokens, Node **resultNode, TokenList ** tokensLeft);
+// How lexing or parsing one file went, for the batch summary
+typedef enum _FileStatus {
+    FileOk,
+    FileOpenFailed,
+    FileLexFailed,
+    FileParseFailed,
+} FileStatus;
 
-ParseError parseExpr(TokenList *tokens, Node **resultNode, TokenList **tokensLeft) {
-    return parseBinaryOp(tokens, resultNode, tokensLeft);
-}
+static const char *fileStatusNames[] = {
+    [FileOk] = "ok",
+    [FileOpenFailed] = "open failed",
+    [FileLexFailed] = "lex failed",
+    [FileParseFailed] = "parse failed",
+};
 
-ParseError parseUnaryOp(TokenList *tokens, Node **resultNode, TokenList **tokensLeft) {
-    if (tokens == NULL) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
-    }
+// What a file runner is asked to do besides its input. threads is how many
+// threads to parse on; cacheDir is where the AST cache lives, or NULL.
+typedef struct _FileOptions {
+    int threads;
+    char *cacheDir;
+    DumpFormat format;
+} FileOptions;
 
-    Node *node;
-    if (ParseSuccess == parseFunCall(tokens, &node, tokensLeft)) {
-        *resultNode = node;
-        return ParseSuccess;
-    }
-    Token *token = tokens->token;
-    if (token->type == IntLit) {
-        Node *node = malloc(sizeof (Node));
-        node->type = IntLiteral;
-        node->data.val = atoi(token->text);
-        copyLocation(&token->location, &node->location);
-        *resultNode = node;
-        *tokensLeft = tokens->next;
-        return ParseSuccess;
-    } else if (token->type == Id) {
-        Node *node = malloc(sizeof (Node));
-        node->type = Identifier;
-        node->data.id = token->text;
-        copyLocation(&token->location, &node->location);
-        *resultNode = node;
-        *tokensLeft = tokens->next;
-        return ParseSuccess;
-    } else if (token->type == StrLit) {
-        Node *node = malloc(sizeof (Node));
-        node->type = StrLiteral;
-        node->data.str = token->text;
-        copyLocation(&token->location, &node->location);
-        *resultNode = node;
-        *tokensLeft = tokens->next;
-        return ParseSuccess;
+// Writes the tree or the parse error to out, for a fresh parse and a cached
+// one alike
+FileStatus printParse(
+    FILE *out,
+    Stats *stats,
+    DumpFormat format,
+    Source *source,
+    Interner *interner,
+    TokenArray *tokens,
+    Ast *ast,
+    NodeIndex program,
+    int result,
+    int posLeft
+) {
+    if (result == ParseSuccess) {
+        phaseStart(stats, "print");
+        dumpAst(out, interner, ast, program, format);
+        fflush(out);
+        phaseEnd(stats, 0);
     } else {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+        reportParseError(out, source, interner, tokens, result, posLeft);
+    }
+    if (stats != NULL) {
+        stats->tokenCount = tokens->count;
+        if (result == ParseSuccess) {
+            countNodes(ast, program, stats->nodeCounts);
+        }
     }
+    return result == ParseSuccess ? FileOk : FileParseFailed;
 }
 
-ParseError parseBinaryOp(TokenList *tokens, Node **resultNode, TokenList **tokensLeft) {
-    Node *lhs;
-    if (ParseSuccess != parseUnaryOp(tokens, &lhs, tokensLeft)) {
-        return ParseNoMatch;
-    }
-    tokens = *tokensLeft;
-    if (tokens == NULL || !isOperator(tokens->token->type)) {
-        *resultNode = lhs;
-        return ParseSuccess;
+// Parses filename on up to options->threads threads and writes the tree or
+// the error to out. Everything it uses is its own, so several files can be
+// parsed at once on different threads. With a cache directory the parse is
+// taken from the cache when the source has been seen before, and saved to
+// it otherwise.
+FileStatus parseFile(char *filename, FILE *out, Stats *stats, FileOptions *options) {
+    Source source;
+    phaseStart(stats, "open");
+    if (openSource(filename, &source) != 0) {
+        fprintf(out, "Failed to open %s\n", filename);
+        return FileOpenFailed;
     }
-    TokenType op = tokens->token->type;
-    tokens = tokens->next;
-    if (tokens == NULL) {
-        *tokensLeft = NULL;
-        return ParseNoMatch;
+    phaseEnd(stats, source.len);
+    char *cachePath = NULL;
+    uint64_t hash = 0;
+    if (options->cacheDir != NULL && source.fd < 0) {
+        AstCache cache;
+        phaseStart(stats, "cache load");
+        hash = hashSource(source.data, source.len);
+        cachePath = astCachePath(options->cacheDir, hash);
+        int hit = loadAstCache(cachePath, hash, &source, &cache) == 0;
+        phaseEnd(stats, hit ? cache.mapLen : 0);
+        if (hit) {
+            FileStatus status = printParse(out, stats, options->format, &source, &cache.interner, &cache.tokens,
+                &cache.ast, cache.program, cache.parseResult, cache.posLeft);
+            closeAstCache(&cache);
+            free(cachePath);
+            closeSource(&source);
+            return status;
+        }
     }
-    Node *rhs;
-    if (ParseSuccess != parseBinaryOp(tokens, &rhs, tokensLeft)) {
-        return ParseNoMatch;
+    Interner interner;
+    TokenArray tokens;
+    TokenizeErrorInfo errorInfo;
+    phaseStart(stats, "tokenize");
+    initInterner(&interner);
+    TokenizeErrorType lexResult = tokenizeSource(&source, &interner, &tokens, &errorInfo);
+    if (lexResult != LexSuccess) {
+        fprintf(out, "Lex failed\n");
+        free(cachePath);
+        freeInterner(&interner);
+        closeSource(&source);
+        return FileLexFailed;
     }
-    Node *ret = malloc(sizeof (Node));
+    phaseEnd(stats, tokenArrayBytes(&tokens) + internerBytes(&interner));
 
-    copyLocationStart(&lhs->location, &ret->location);
-    copyLocationEnd(&rhs->location, &ret->location);
+    Ast ast;
+    phaseStart(stats, "parse");
+    initAst(&ast);
+    Parser parser;
+    parser.source = &source;
+    parser.tokens = &tokens;
+    parser.ast = &ast;
+    parser.interner = &interner;
+    NodeIndex resultNode = 0;
+    int posLeft;
     
-    if (rhs->type == BinaryOp) {
-        int rhsOp = rhs->data.binOp.op;
-        if (opPrec(op) > opPrec(rhsOp)) {
-            // Reshape the tree
-            Node *newLhs = malloc(sizeof (Node));
-            newLhs->type = BinaryOp;
-            newLhs->data.binOp.lhs = lhs;
-            newLhs->data.binOp.op = op;
-            newLhs->data.binOp.rhs = rhs->data.binOp.lhs;
-            ret->type = BinaryOp;
-            ret->data.binOp.lhs = newLhs;
-            ret->data.binOp.op = rhs->data.binOp.op;
-            ret->data.binOp.rhs = rhs->data.binOp.rhs;
-            free(rhs);
-            *resultNode = ret;
-            return ParseSuccess;
-        }
-    }
-    ret->type = BinaryOp;
-    ret->data.binOp.lhs = lhs;
-    ret->data.binOp.rhs = rhs;
-    ret->data.binOp.op = op;
-    *resultNode = ret;
-    return ParseSuccess;
+    int result = parseParallel(&parser, options->threads, &resultNode, &posLeft);
+    phaseEnd(stats, astBytes(&ast));
+    if (cachePath != NULL) {
+        phaseStart(stats, "cache save");
+        saveAstCache(options->cacheDir, cachePath, hash, &source, &interner, &tokens, &ast,
+            resultNode, result, posLeft);
+        phaseEnd(stats, 0);
+        free(cachePath);
+    }
+    FileStatus status = printParse(out, stats, options->format, &source, &interner, &tokens, &ast,
+        resultNode, result, posLeft);
+    freeAst(&ast);
+    freeTokenArray(&tokens);
+    freeInterner(&interner);
+    closeSource(&source);
+    return status;
 }
 
-ParseError parseVarAssign(
-    TokenList *tokens,
-    Node **resultNode,
-    TokenList **tokensLeft
-) {
-    if (tokens == NULL) {
-        *tokensLeft = NULL;
-        return ParseNoMatch;
-    }
-    Token *typeIdToken = tokens->token;
-    if (typeIdToken->type != Id) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+FileStatus lexFile(char *filename, FILE *out, Stats *stats, FileOptions *options) {
+    Source source;
+    phaseStart(stats, "open");
+    if (openSource(filename, &source) != 0) {
+        fprintf(out, "Failed to open %s\n", filename);
+        return FileOpenFailed;
     }
-    tokens = tokens->next;
-    Token *varNameToken = tokens->token;
-    if (varNameToken->type != Id) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+    phaseEnd(stats, source.len);
+    Interner interner;
+    TokenArray tokens;
+    TokenizeErrorInfo errorInfo;
+    phaseStart(stats, "tokenize");
+    initInterner(&interner);
+    TokenizeErrorType err = tokenizeSource(&source, &interner, &tokens, &errorInfo);
+    if (err != 0) {
+        fprintf(out, "Tokenize error: %d\n", err);
+        fprintf(out, "Line %" PRId64 ", char %" PRId64 ", offset %" PRId64 "\n",
+            errorInfo.line, errorInfo.character, errorInfo.offset);
+        freeInterner(&interner);
+        closeSource(&source);
+        return FileLexFailed;
     }
-    tokens = tokens->next;
-    Token *assignToken = tokens->token;
-    if (assignToken->type != AssignOp) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+    phaseEnd(stats, tokenArrayBytes(&tokens) + internerBytes(&interner));
+
+    phaseStart(stats, "print");
+    dumpTokens(out, &interner, &tokens, options->format);
+    fflush(out);
+    phaseEnd(stats, 0);
+    if (stats != NULL) {
+        stats->tokenCount = tokens.count;
     }
-    tokens = tokens->next;
-    Token *initValueToken = tokens->token;
-    Node *initValue;
-    TokenList *left;
-    int result = parseExpr(tokens, &initValue, &left);
-    if (result != ParseSuccess) {
-        return result;
+    freeTokenArray(&tokens);
+    freeInterner(&interner);
+    closeSource(&source);
+    return FileOk;
+}
+
+void parseCommand(char *filename, Stats *stats, FileOptions *options) {
+    if (parseFile(filename, stdout, stats, options) == FileOpenFailed) {
+        exit(1);
     }
+}
 
-    *tokensLeft = left;
+void lexCommand(char *filename, Stats *stats, FileOptions *options) {
+    FileStatus status = lexFile(filename, stdout, stats, options);
+    if (status != FileOk) {
+        exit(1);
+    }
+}
 
-    // Create the node
-    Node *varAssign = malloc(sizeof (Node));
-    copyLocationStart(&typeIdToken->location, &varAssign->location);
-    copyLocationEnd(&initValue->location, &varAssign->location);
-    
-    Node *varType = malloc(sizeof (Node));
-    varType->type = TypeIdentifier;
-    copyLocation(&typeIdToken->location, &varType->location);
-    varType->data.id = typeIdToken->text;
+void reportCompileError(TokenArray *tokens, CompileError error, Node *node) {
+    int line = lineOfOffset(tokens, node->start);
+    printf("Compile error: %s at line %d, char %d\n",
+        compileErrorMessages[error], line, columnOfOffset(tokens, node->start, line));
+}
 
-    Node *varName = malloc(sizeof (Node));
-    varName->type = Identifier;
-    copyLocation(&varNameToken->location, &varName->location);
-    varName->data.id = varNameToken->text;
+#define MAX_REPORTED_DIAGNOSTICS 20
 
-    varAssign->type = VarAssign;
-    varAssign->data.varAssign.varType = varType;
-    varAssign->data.varAssign.varName = varName;
-    varAssign->data.varAssign.initValue = initValue;
+void exitOnDiagnostics(TokenArray *tokens, Diagnostics *diagnostics) {
+    if (diagnostics->count == 0) {
+        return;
+    }
+    for (int i = 0; i < diagnostics->count && i < MAX_REPORTED_DIAGNOSTICS; i++) {
+        reportCompileError(tokens, diagnostics->items[i].error, diagnostics->items[i].node);
+    }
+    if (diagnostics->count > MAX_REPORTED_DIAGNOSTICS) {
+        printf("and %d more errors\n", diagnostics->count - MAX_REPORTED_DIAGNOSTICS);
+    }
+    exit(1);
+}
 
-    *resultNode = varAssign;
-    return 0;
+// Resolves the names of program for run and compile and then checks its
+// types. The problems found are reported, up to MAX_REPORTED_DIAGNOSTICS of
+// them, and the process exits if there was any; types are only checked
+// once every name is known. Returns the frame size of the program.
+int checkOrExit(Interner *interner, TokenArray *tokens, Ast *ast, NodeIndex program, Stats *stats) {
+    Diagnostics diagnostics;
+    initDiagnostics(&diagnostics);
+    phaseStart(stats, "resolve");
+    int frameSize = resolveProgram(interner, ast, program, &diagnostics);
+    phaseEnd(stats, 0);
+    exitOnDiagnostics(tokens, &diagnostics);
+    phaseStart(stats, "check");
+    checkProgram(interner, ast, program, frameSize, &diagnostics);
+    phaseEnd(stats, 0);
+    exitOnDiagnostics(tokens, &diagnostics);
+    freeDiagnostics(&diagnostics);
+    return frameSize;
 }
 
-ParseError parseFunCall(
-    TokenList *tokens,
-    Node **resultNode,
-    TokenList **tokensLeft
-) {
-    if (tokens == NULL) {
-        *tokensLeft = NULL;
-        return ParseNoMatch;
-    }
-    Token *funName = tokens->token;
-    if (funName->type != Id) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+// A program taken through the front end that run, compile and jit share
+typedef struct _CheckedProgram {
+    Source source;
+    Interner interner;
+    TokenArray tokens;
+    Ast ast;
+    NodeIndex program;
+    int frameSize;
+} CheckedProgram;
+
+// Opens, lexes, parses, checks and optimizes filename into checked. Any
+// problem is reported and the process exits.
+void loadCheckedProgram(char *filename, Stats *stats, CheckedProgram *checked) {
+    Source *source = &checked->source;
+    phaseStart(stats, "open");
+    if (openSource(filename, source) != 0) {
+        printf("Failed to open %s\n", filename);
+        exit(1);
     }
-    tokens = tokens->next;
-    if (tokens == NULL || tokens->token->type != LeftParan) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+    phaseEnd(stats, source->len);
+    Interner *interner = &checked->interner;
+    TokenArray *tokens = &checked->tokens;
+    TokenizeErrorInfo errorInfo;
+    phaseStart(stats, "tokenize");
+    initInterner(interner);
+    if (tokenizeSource(source, interner, tokens, &errorInfo) != LexSuccess) {
+        printf("Tokenize error at line %" PRId64 ", char %" PRId64 "\n",
+            errorInfo.line, errorInfo.character);
+        exit(1);
     }
+    phaseEnd(stats, tokenArrayBytes(tokens) + internerBytes(interner));
 
-    tokens = tokens->next;
-    NodeList *args = NULL;
-    NodeList *argsTail = NULL;
-    while (1) {
-        Node *arg;
-        TokenList *left;
-        int result = parseExpr(tokens, &arg, &left);
-        if (result == ParseSuccess) {
-            tokens = left;
-            if (tokens == NULL) {
-                *tokensLeft = NULL;
-                return ParseNoMatch;
-            }
-            NodeList *next = malloc(sizeof (NodeList));
-            next->node = arg;
-            next->next = NULL;
-            if (args == NULL) {
-                args = next;
-                argsTail = next;
-            } else {
-                argsTail->next = next;
-                argsTail = next;
-            }
-            if (tokens->token->type != Comma) {
-                break;
-            } else {
-                tokens = tokens->next;
-            }
-        } else {
-            return result;
-        }
-    }
-    if (tokens->token->type != RightParan) {
-        // TODO: free args
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+    Ast *ast = &checked->ast;
+    phaseStart(stats, "parse");
+    initAst(ast);
+    Parser parser;
+    parser.source = source;
+    parser.tokens = tokens;
+    parser.ast = ast;
+    parser.interner = interner;
+    int posLeft;
+    int result = parse(&parser, &checked->program, &posLeft);
+    if (result != ParseSuccess) {
+        reportParseError(stdout, source, interner, tokens, result, posLeft);
+        exit(1);
     }
+    phaseEnd(stats, astBytes(ast));
+    checked->frameSize = checkOrExit(interner, tokens, ast, checked->program, stats);
 
-    Node *retval = malloc(sizeof (Node));
-    copyLocationStart(&funName->location, &retval->location);
-    copyLocationEnd(&argsTail->node->location, &retval->location);
-    retval->type = FunCall;
-    Node *funNameNode = malloc(sizeof (Node));
-    funNameNode->type = Identifier;
-    copyLocation(&funName->location, &funNameNode->location);
-    funNameNode->data.id = funName->text;
-    retval->data.funCall.funName = funNameNode;
-    retval->data.funCall.args = args;
-    *resultNode = retval;
-    *tokensLeft = tokens->next;
-    return ParseSuccess;
+    phaseStart(stats, "optimize");
+    int removedNodes = optimizeProgram(interner, ast, checked->program);
+    phaseEnd(stats, 0);
+    if (stats != NULL) {
+        stats->optimized = 1;
+        stats->removedNodes = removedNodes;
+    }
 }
 
-ParseError parseIfStatement(TokenList *tokens, Node** resultNode, TokenList **tokensLeft) {
-    if (tokens == NULL) {
-        *tokensLeft = NULL;
-        return ParseNoMatch;
+// Counts what the program was made of into stats, once a back end is done
+// with it, and frees it
+void freeCheckedProgram(CheckedProgram *checked, Stats *stats) {
+    if (stats != NULL) {
+        stats->tokenCount = checked->tokens.count;
+        countNodes(&checked->ast, checked->program, stats->nodeCounts);
     }
+    freeAst(&checked->ast);
+    freeTokenArray(&checked->tokens);
+    freeInterner(&checked->interner);
+    closeSource(&checked->source);
+}
 
-    Token *ifKeyword = tokens->token;
-    if (ifKeyword->type != Id) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+// Parses filename, lowers it to bytecode and runs that
+void runCommand(char *filename, Stats *stats) {
+    CheckedProgram checked;
+    loadCheckedProgram(filename, stats, &checked);
+    Bytecode bytecode;
+    Node *errorNode;
+    phaseStart(stats, "compile");
+    CompileError compileError = compileProgram(
+        &checked.interner, &checked.tokens, &checked.ast, checked.program, checked.frameSize,
+        &bytecode, &errorNode
+    );
+    if (compileError != CompileSuccess) {
+        reportCompileError(&checked.tokens, compileError, errorNode);
+        exit(1);
     }
-    if (strcmp(ifKeyword->text, "if") != 0) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+    phaseEnd(stats, (size_t)bytecode.capacity * (sizeof (int32_t) + sizeof (int)));
+
+    int errorLine;
+    phaseStart(stats, "run");
+    RuntimeError runError = runBytecode(&bytecode, stdout, &errorLine);
+    fflush(stdout);
+    phaseEnd(stats, 0);
+    if (runError != RunSuccess) {
+        printf("Runtime error: %s at line %d\n", runtimeErrorMessages[runError], errorLine);
+        exit(1);
     }
-    tokens = tokens->next;
-    Node *cond;
-    if (ParseSuccess !=  parseExpr(tokens, &cond, tokensLeft)) {
-        return ParseNoMatch;
+    freeBytecode(&bytecode);
+    freeCheckedProgram(&checked, stats);
+}
+
+// Parses filename and writes it out as x86-64 assembly
+void compileCommand(char *filename, Stats *stats) {
+    CheckedProgram checked;
+    loadCheckedProgram(filename, stats, &checked);
+    Buffer assembly;
+    Node *errorNode;
+    phaseStart(stats, "codegen");
+    initBuffer(&assembly);
+    CompileError compileError = generateAssembly(
+        &checked.tokens, &checked.interner, &checked.ast, checked.program, checked.frameSize,
+        &assembly, &errorNode
+    );
+    if (compileError != CompileSuccess) {
+        reportCompileError(&checked.tokens, compileError, errorNode);
+        exit(1);
     }
-    tokens = *tokensLeft;
-    if (tokens == NULL) {
-        return ParseNoMatch;
+    fwrite(assembly.data, 1, assembly.len, stdout);
+    fflush(stdout);
+    phaseEnd(stats, assembly.len);
+    free(assembly.data);
+    freeCheckedProgram(&checked, stats);
+}
+
+// Parses filename, turns it into machine code in memory and runs it
+void jitCommand(char *filename, Stats *stats) {
+#if !defined(__x86_64__)
+    printf("pipa jit needs an x86-64 host\n");
+    exit(1);
+#endif
+    CheckedProgram checked;
+    loadCheckedProgram(filename, stats, &checked);
+    Buffer code;
+    Node *errorNode;
+    StringPool strings;
+    phaseStart(stats, "jit");
+    initStringPool(&strings, &checked.interner);
+    CompileError compileError = jitProgram(
+        &checked.tokens, &checked.interner, &checked.ast, checked.program, &strings, &code, &errorNode
+    );
+    if (compileError != CompileSuccess) {
+        reportCompileError(&checked.tokens, compileError, errorNode);
+        exit(1);
     }
-    if (tokens->token->type != LeftBrace) {
-        return ParseNoMatch;
+    JitFunction function = loadJitCode(&code);
+    if (function == NULL) {
+        printf("Failed to map memory for the JIT\n");
+        exit(1);
     }
-    tokens = tokens->next;
+    phaseEnd(stats, code.len);
 
-    NodeList *statements;
-    if (ParseSuccess != parseStatements(tokens, &statements, tokensLeft)) {
-        return ParseNoMatch;
+    int errorLine;
+    phaseStart(stats, "run");
+    RuntimeError runError = runJitCode(function, checked.frameSize, stdout, &errorLine);
+    fflush(stdout);
+    phaseEnd(stats, 0);
+    if (runError != RunSuccess) {
+        printf("Runtime error: %s at line %d\n", runtimeErrorMessages[runError], errorLine);
+        exit(1);
     }
-    tokens = *tokensLeft;
-    if (tokens == NULL || tokens->token->type != RightBrace) {
-        return ParseNoMatch;
+    munmap((void *)function, code.len);
+    free(code.data);
+    freeStringPool(&strings);
+    freeCheckedProgram(&checked, stats);
+}
+
+typedef FileStatus (*FileRunner)(char *filename, FILE *out, Stats *stats, FileOptions *options);
+
+typedef struct _BatchJob {
+    char *filename;
+    char *output;
+    size_t outputLen;
+    FileStatus status;
+    int done;
+} BatchJob;
+
+// Jobs [head, tail) still to be run. The owning worker takes from the head
+// and idle workers steal from the tail, so the two rarely meet.
+typedef struct _WorkQueue {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+} WorkQueue;
+
+typedef struct _Batch {
+    BatchJob *jobs;
+    int jobCount;
+    WorkQueue *queues;
+    int workerCount;
+    FileRunner run;
+    FileOptions *options;
+    pthread_mutex_t doneLock;
+    pthread_cond_t doneCond;
+} Batch;
+
+typedef struct _Worker {
+    Batch *batch;
+    int index;
+    pthread_t thread;
+} Worker;
+
+int takeJob(WorkQueue *queue, int steal) {
+    int job = -1;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail) {
+        job = steal ? --queue->tail : queue->head++;
     }
-    Token *rightBrace = tokens->token;
-    tokens = tokens->next;
-    *tokensLeft = tokens;
-    Node *retval = malloc(sizeof (Node));
-    copyLocationStart(&ifKeyword->location, &retval->location);
-    copyLocationEnd(&rightBrace->location, &retval->location);
-    retval->type = IfStatement;
-    retval->data.ifStatement.cond = cond;
-    retval->data.ifStatement.consequent = statements;
-    *resultNode = retval;
-    return ParseSuccess;
+    pthread_mutex_unlock(&queue->lock);
+    return job;
 }
 
-ParseError parseLoopStatement(TokenList *tokens, Node **resultNode, TokenList ** tokensLeft) {
-    if (tokens == NULL) {
-        *tokensLeft = NULL;
-        return ParseNoMatch;
+void *runWorker(void *arg) {
+    Worker *worker = arg;
+    Batch *batch = worker->batch;
+    while (1) {
+        int job = takeJob(&batch->queues[worker->index], 0);
+        // Nothing is ever added, so once every queue is empty we are done
+        for (int i = 1; job < 0 && i < batch->workerCount; i++) {
+            job = takeJob(&batch->queues[(worker->index + i) % batch->workerCount], 1);
+        }
+        if (job < 0) {
+            return NULL;
+        }
+        BatchJob *batchJob = &batch->jobs[job];
+        FILE *out = open_memstream(&batchJob->output, &batchJob->outputLen);
+        batchJob->status = batch->run(batchJob->filename, out, NULL, batch->options);
+        fclose(out);
+        pthread_mutex_lock(&batch->doneLock);
+        batchJob->done = 1;
+        pthread_cond_broadcast(&batch->doneCond);
+        pthread_mutex_unlock(&batch->doneLock);
     }
+}
 
-    Token *loopKeyword = tokens->token;
-    if (loopKeyword->type != Id) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+// Runs run over every file on workerCount threads. Each worker starts with
+// an even share of the files and steals from the others when it runs out.
+// Output is written in input order as soon as it is ready, followed by a
+// summary on stderr. Returns the number of files that failed.
+int runBatch(FileRunner run, FileOptions *options, char **filenames, int fileCount, int workerCount) {
+    Batch batch;
+    batch.jobCount = fileCount;
+    batch.jobs = calloc(fileCount, sizeof (BatchJob));
+    for (int i = 0; i < fileCount; i++) {
+        batch.jobs[i].filename = filenames[i];
+    }
+    if (workerCount > fileCount) {
+        workerCount = fileCount > 0 ? fileCount : 1;
+    }
+    batch.workerCount = workerCount;
+    batch.run = run;
+    batch.options = options;
+    batch.queues = malloc(sizeof (WorkQueue) * workerCount);
+    for (int i = 0; i < workerCount; i++) {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].head = (int64_t)fileCount * i / workerCount;
+        batch.queues[i].tail = (int64_t)fileCount * (i + 1) / workerCount;
+    }
+    pthread_mutex_init(&batch.doneLock, NULL);
+    pthread_cond_init(&batch.doneCond, NULL);
+    Worker *workers = malloc(sizeof (Worker) * workerCount);
+    for (int i = 0; i < workerCount; i++) {
+        workers[i].batch = &batch;
+        workers[i].index = i;
+        pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]);
     }
 
-    if (strcmp(loopKeyword->text, "loop") != 0) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+    for (int i = 0; i < fileCount; i++) {
+        BatchJob *job = &batch.jobs[i];
+        pthread_mutex_lock(&batch.doneLock);
+        while (!job->done) {
+            pthread_cond_wait(&batch.doneCond, &batch.doneLock);
+        }
+        pthread_mutex_unlock(&batch.doneLock);
+        printf("==> %s <==\n", job->filename);
+        fwrite(job->output, 1, job->outputLen, stdout);
+        free(job->output);
+        job->output = NULL;
+    }
+    fflush(stdout);
+    for (int i = 0; i < workerCount; i++) {
+        pthread_join(workers[i].thread, NULL);
     }
 
-    tokens = tokens->next;
-    if (tokens->token->type != LeftBrace) {
-        return ParseNoMatch;
+    int failed = 0;
+    for (int i = 0; i < fileCount; i++) {
+        fprintf(stderr, "%-12s %s\n", fileStatusNames[batch.jobs[i].status], batch.jobs[i].filename);
+        if (batch.jobs[i].status != FileOk) {
+            failed++;
+        }
+    }
+    fprintf(stderr, "%d files, %d failed\n", fileCount, failed);
+    for (int i = 0; i < workerCount; i++) {
+        pthread_mutex_destroy(&batch.queues[i].lock);
     }
-    tokens = tokens->next;
+    pthread_mutex_destroy(&batch.doneLock);
+    pthread_cond_destroy(&batch.doneCond);
+    free(workers);
+    free(batch.queues);
+    free(batch.jobs);
+    return failed;
+}
 
-    NodeList *statements;
-    if (ParseSuccess != parseStatements(tokens, &statements, tokensLeft)) {
-        return ParseNoMatch;
+// Batch mode takes the files to run from the command line, or one per
+// line from stdin when none are given
+void batchCommand(FileRunner run, FileOptions *options, char **filenames, int fileCount, int workerCount) {
+    char **names = filenames;
+    int capacity = 0;
+    if (fileCount == 0) {
+        capacity = 64;
+        names = malloc(sizeof (char *) * capacity);
+        char *line = NULL;
+        size_t lineCap = 0;
+        ssize_t read;
+        while ((read = getline(&line, &lineCap, stdin)) != -1) {
+            if (read > 0 && line[read - 1] == '\n') {
+                line[--read] = 0;
+            }
+            if (read == 0) {
+                continue;
+            }
+            if (fileCount == capacity) {
+                capacity *= 2;
+                names = realloc(names, sizeof (char *) * capacity);
+            }
+            names[fileCount++] = strdup(line);
+        }
+        free(line);
     }
-    tokens = *tokensLeft;
-    if (tokens == NULL || tokens->token->type != RightBrace) {
-        return ParseNoMatch;
+    int failed = runBatch(run, options, names, fileCount, workerCount);
+    if (capacity > 0) {
+        for (int i = 0; i < fileCount; i++) {
+            free(names[i]);
+        }
+        free(names);
+    }
+    if (failed > 0) {
+        exit(1);
     }
-    Token *rightBrace = tokens->token;
-    tokens = tokens->next;
-    *tokensLeft = tokens;
-    Node *retval = malloc(sizeof (Node));
-    copyLocationStart(&loopKeyword->location, &retval->location);
-    copyLocationEnd(&rightBrace->location, &retval->location);
-    retval->type = LoopStatement;
-    retval->data.loopStatement.body = statements;
-    *resultNode = retval;
-    return ParseSuccess;
 }
 
-ParseError parseBreakStatement(TokenList *tokens, Node **resultNode, TokenList ** tokensLeft) {
-    if (tokens == NULL) {
-        *tokensLeft = NULL;
-        return ParseNoMatch;
+void printDocument(Document *doc, ParseError result, TokenizeErrorType lexResult, int posLeft) {
+    if (lexResult != LexSuccess) {
+        printf("Lex failed\n");
+    } else if (result != ParseSuccess) {
+        reportParseError(stdout, &doc->source, &doc->interner, &doc->tokens, result, posLeft);
+    } else {
+        settleDocument(doc);
+        dumpAst(stdout, &doc->interner, &doc->ast, doc->program, DumpText);
     }
+    printf("--\n");
+    fflush(stdout);
+}
 
-    Token *breakKeyword = tokens->token;
-    if (breakKeyword->type != Id) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+// Keeps filename parsed while edits arrive on stdin, for editor integration.
+// Each edit is a line "<start> <old length> <new length>" followed by the
+// new bytes; the tree (or the error) is printed after the file is loaded and
+// after every edit, each time followed by a "--" line.
+void editCommand(char *filename) {
+    Source file;
+    if (strcmp(filename, "-") == 0 || openSource(filename, &file) != 0 || file.fd >= 0) {
+        printf("Failed to open %s\n", filename);
+        exit(1);
     }
+    Buffer text;
+    initBuffer(&text);
+    bufferAppend(&text, file.data, file.len);
+    closeSource(&file);
 
-    if (strcmp(breakKeyword->text, "break") != 0) {
-        *tokensLeft = tokens;
-        return ParseNoMatch;
+    Document doc;
+    initDocument(&doc);
+    doc.source.data = text.data;
+    doc.source.len = text.len;
+    doc.source.fd = -1;
+    TokenizeErrorType lexResult;
+    int posLeft;
+    ParseError result = buildDocument(&doc, &lexResult, &posLeft);
+    printDocument(&doc, result, lexResult, posLeft);
+
+    SourceEdit edit;
+    while (scanf("%" SCNd64 " %" SCNd64 " %" SCNd64, &edit.start, &edit.oldLength, &edit.newLength) == 3) {
+        getchar();
+        if (edit.start < 0 || edit.oldLength < 0 || edit.newLength < 0 ||
+                edit.start + edit.oldLength > (int64_t)text.len) {
+            printf("Bad edit\n");
+            exit(1);
+        }
+        int64_t tail = text.len - edit.start - edit.oldLength;
+        bufferReserve(&text, edit.newLength);
+        memmove(
+            text.data + edit.start + edit.newLength,
+            text.data + edit.start + edit.oldLength,
+            tail
+        );
+        if (fread(text.data + edit.start, 1, edit.newLength, stdin) != (size_t)edit.newLength) {
+            printf("Bad edit\n");
+            exit(1);
+        }
+        text.len += edit.newLength - edit.oldLength;
+        Source source;
+        source.data = text.data;
+        source.len = text.len;
+        source.fd = -1;
+        result = editDocument(&doc, &source, &edit, 1, &lexResult, &posLeft);
+        printDocument(&doc, result, lexResult, posLeft);
     }
-    *tokensLeft = tokens->next;
+    freeDocument(&doc);
+    free(text.data);
+}
 
-    Node *retval = malloc(sizeof (Node));
-    retval->type = BreakStatement;
-    copyLocationStart(&breakKeyword->location, &retval->location);
-    copyLocationEnd(&breakKeyword->location, &retval->location);
-    *resultNode = retval;
-    return ParseSuccess;
+typedef struct _GenOptions {
+    int statements;
+    int depth;
+    int width;
+    int blockPercent;
+    int stringPercent;
+    int commentPercent;
+    int iterations;
+    int threads;
+    int nesting;
+    uint32_t seed;
+} GenOptions;
+
+uint32_t genRandom(uint32_t *state) {
+    // xorshift32, deterministic for a given seed
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
 }
 
-ParseError parseStatement(TokenList *tokens, Node **resultNode, TokenList **tokensLeft) {
-    if (ParseSuccess == parseVarAssign(tokens, resultNode, tokensLeft)) {
-        return ParseSuccess;
-    }
-    if (ParseSuccess == parseFunCall(tokens, resultNode, tokensLeft)) {
-        return ParseSuccess;
-    }
-    if (ParseSuccess == parseIfStatement(tokens, resultNode, tokensLeft)) {
-        return ParseSuccess;
-    }
-    if (ParseSuccess == parseLoopStatement(tokens, resultNode, tokensLeft)) {
-        return ParseSuccess;
-    }
-    if (ParseSuccess == parseBreakStatement(tokens, resultNode, tokensLeft)) {
-        return ParseSuccess;
+void genIndent(Buffer *out, int depth) {
+    // Cap the indent so that very deep nesting does not dominate the size
+    int indent = depth < 32 ? depth : 32;
+    for (int i = 0; i < indent; i++) {
+        bufferAppend(out, "    ", 4);
     }
-    return ParseNoMatch;
 }
 
-ParseError parseStatements(TokenList *tokens, NodeList **statementsOut, TokenList **tokensLeft) {
-    NodeList *statements = NULL;
-    NodeList *statementsTail = NULL;
-    while (tokens->token->type == Newline) {
-        tokens = tokens->next;
-    }
-    while (1) {
-        if (tokens != NULL && RightBrace == tokens->token->type) {
-            break;
+void genName(Buffer *out, uint32_t *rand) {
+    // Letters only, and always at least three so no keyword is produced
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz";
+    uint32_t n = genRandom(rand) % 4096;
+    char name[4];
+    name[0] = 'v';
+    name[1] = letters[n % 26];
+    name[2] = letters[(n / 26) % 26];
+    bufferAppend(out, name, 3);
+}
+
+void genWords(Buffer *out, uint32_t *rand, int escapes) {
+    static const char *words[] = {
+        "hello", "world", "pipa", "compiler", "token", "tab\\there", "say \\\"hi\\\"",
+    };
+    int count = 1 + genRandom(rand) % 4;
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            bufferAppend(out, " ", 1);
         }
-        Node *stmtNode;
-        TokenList *stmtTokensLeft;
-        if (ParseSuccess != parseStatement(tokens, &stmtNode, &stmtTokensLeft)) {
-            return ParseNoMatch;
+        bufferAppendStr(out, words[genRandom(rand) % (escapes ? 7 : 5)]);
+    }
+}
+
+void genStr(Buffer *out, uint32_t *rand) {
+    bufferAppend(out, "\"", 1);
+    genWords(out, rand, 1);
+    bufferAppend(out, "\"", 1);
+}
+
+void genExpr(Buffer *out, GenOptions *options, uint32_t *rand, int comparison) {
+    static const char *ops[] = { " + ", " - ", " * ", " / " };
+    static const char *compareOps[] = { " < ", " <= ", " > ", " >= ", " == " };
+    int compareAt = comparison ? (int)(genRandom(rand) % options->width) : -1;
+    for (int i = 0; i < options->width; i++) {
+        if (i > 0) {
+            if (i == compareAt) {
+                bufferAppendStr(out, compareOps[genRandom(rand) % 5]);
+            } else {
+                bufferAppendStr(out, ops[genRandom(rand) % 4]);
+            }
         }
-        NodeList *next = malloc(sizeof (NodeList));
-        next->node = stmtNode;
-        next->next = NULL;
-        if (statements == NULL) {
-            statements = next;
-            statementsTail = next;
+        if (genRandom(rand) % 2) {
+            genName(out, rand);
         } else {
-            statementsTail->next = next;
-            statementsTail = next;
+            bufferPrintf(out, "%u", genRandom(rand) % 1000);
         }
-        tokens = stmtTokensLeft;
-        while (tokens != NULL && tokens->token->type == Newline) {
-            tokens = tokens->next;
+    }
+    if (comparison && compareAt <= 0) {
+        bufferAppendStr(out, compareOps[genRandom(rand) % 5]);
+        bufferPrintf(out, "%u", genRandom(rand) % 1000);
+    }
+}
+
+void genSimpleStatement(Buffer *out, GenOptions *options, uint32_t *rand) {
+    uint32_t kind = genRandom(rand) % 2;
+    if (genRandom(rand) % 100 < (uint32_t)options->stringPercent) {
+        if (kind == 0) {
+            bufferAppendStr(out, "str ");
+            genName(out, rand);
+            bufferAppendStr(out, " = ");
+            genStr(out, rand);
+        } else {
+            bufferAppendStr(out, "print(");
+            genStr(out, rand);
+            bufferAppendStr(out, ", ");
+            genName(out, rand);
+            bufferAppendStr(out, ")");
         }
-        if (tokens == NULL) {
-            break;
+    } else {
+        if (kind == 0) {
+            bufferAppendStr(out, "int ");
+            genName(out, rand);
+            bufferAppendStr(out, " = ");
+            genExpr(out, options, rand, 0);
+        } else {
+            bufferAppendStr(out, "print(");
+            genExpr(out, options, rand, 0);
+            bufferAppendStr(out, ", ");
+            genName(out, rand);
+            bufferAppendStr(out, ")");
         }
     }
-    (*tokensLeft) = tokens;
-    (*statementsOut) = statements;
-    return ParseSuccess;
 }
 
-ParseError parse(TokenList *tokens, Node **resultNode, TokenList **tokensLeft) {
-    NodeList *statements = NULL;
-    if (ParseSuccess != parseStatements(tokens, &statements, tokensLeft)) {
-        return ParseNoMatch;
+// Writes a valid program whose blocks nest options->nesting deep, ifs and
+// loops in turn, around a print of an expression with as many terms. Every
+// phase walks it, so it shows that none of them walks on the C stack. It
+// prints the nesting. Nothing is indented, or the indents would dominate.
+void generateNested(Buffer *out, GenOptions *options) {
+    int nesting = options->nesting;
+    bufferAppendStr(out, "int n = 0\n");
+    for (int i = 0; i < nesting; i++) {
+        bufferAppendStr(out, i % 2 == 0 ? "if n == 0 {\n" : "loop {\n");
     }
-
-    Node *program = malloc(sizeof (Node));
-    program->type = Program;
-    program->data.program.statements = statements;
-    *resultNode = program;
-    if (*tokensLeft != NULL) {
-        *resultNode = program;
-        return ParseExtraTokens;
+    bufferAppendStr(out, "int n = n + 1\nprint(n");
+    for (int i = 1; i < nesting; i++) {
+        bufferAppendStr(out, " + n");
+    }
+    bufferAppendStr(out, ")\n");
+    for (int i = nesting - 1; i >= 0; i--) {
+        bufferAppendStr(out, i % 2 == 0 ? "}\n" : "break\n}\n");
     }
-    return ParseSuccess;
 }
 
-void reportParseError(char *filename, int parseResult, TokenList *tokensLeft) {
-    printf("Parse error:\n");
-    Token *token = tokensLeft == NULL ? NULL : tokensLeft->token;
-    FILE *file = fopen(filename, "r");
-    char *line = NULL;
-    size_t lineCap = 0;
-    int lineNo = 1;
-    printf("Unexpected ");
-    if (token == NULL) {
-        char *lastLine = NULL;
-        printf("end of file\n");
-        while (1) {
-            int read = getline(&line, &lineCap, file);
-            if (read == -1) {
-                break;
-            }
-            if (lastLine != NULL) {
-                free(lastLine);
-                lastLine = NULL;
+// Writes a random program of options->statements statements to out. Blocks
+// are tracked on an explicit stack so any nesting depth can be generated.
+void generateProgram(Buffer *out, GenOptions *options) {
+    if (options->nesting > 0) {
+        generateNested(out, options);
+        return;
+    }
+    uint32_t rand = options->seed != 0 ? options->seed : 1;
+    int depth = 0;
+    int stackCapacity = 64;
+    int *remaining = malloc(sizeof (int) * stackCapacity);
+    char *isLoop = malloc(stackCapacity);
+    int emitted = 0;
+    while (emitted < options->statements || depth > 0) {
+        if (depth > 0 && (remaining[depth - 1] == 0 || emitted >= options->statements)) {
+            depth--;
+            if (isLoop[depth]) {
+                genIndent(out, depth + 1);
+                bufferAppendStr(out, "break\n");
             }
-            lastLine = malloc(read);
-            strcpy(lastLine, line);
-            lineNo++;
+            genIndent(out, depth);
+            bufferAppendStr(out, "}\n");
+            continue;
         }
-        printf("%*d  %s\n", 3, lineNo, lastLine);
-        free(lastLine);
-        printf("     ");
-        for (int i = 0; i < strlen(lastLine); i++) {
-            printf(" ");
+        if (genRandom(&rand) % 100 < (uint32_t)options->commentPercent) {
+            genIndent(out, depth);
+            bufferAppendStr(out, "# ");
+            genWords(out, &rand, 0);
+            bufferAppendStr(out, "\n");
         }
-        printf("^\n");
-    } else {
-        printToken(token, 0);
-        int printMore = 0;
-        while (1) {
-            int read = getline(&line, &lineCap, file);
-            if (read == -1) {
-                break;
-            }
-            if (printMore > 0) {
-                printf("%*d  %s", 3, lineNo, line);
-                printMore--;
+        genIndent(out, depth);
+        if (depth > 0) {
+            remaining[depth - 1]--;
+        }
+        emitted++;
+        if (depth < options->depth && genRandom(&rand) % 100 < (uint32_t)options->blockPercent) {
+            if (depth == stackCapacity) {
+                stackCapacity *= 2;
+                remaining = realloc(remaining, sizeof (int) * stackCapacity);
+                isLoop = realloc(isLoop, stackCapacity);
             }
-            if (token != NULL && token->location.startLine == lineNo) {
-                printf("%*d  %s", 3, lineNo, line);
-                printf("     ");
-                for (int i = 1; i < token->location.startChar; i++) {
-                    printf(" ");
-                }
-                printf("^\n");
-                printMore = 4;
+            isLoop[depth] = genRandom(&rand) % 2;
+            if (isLoop[depth]) {
+                bufferAppendStr(out, "loop {\n");
+            } else {
+                bufferAppendStr(out, "if ");
+                genExpr(out, options, &rand, 1);
+                bufferAppendStr(out, " {\n");
             }
-            lineNo++;
+            remaining[depth] = 1 + genRandom(&rand) % 3;
+            depth++;
+        } else {
+            genSimpleStatement(out, options, &rand);
+            bufferAppendStr(out, "\n");
         }
-        printf("\n");
     }
-    fclose(file);
+    free(remaining);
+    free(isLoop);
 }
 
-void parseCommand(char *filename) {
-    FILE *file = fopen(filename, "r");
-    TokenList *tokens;
-    TokenizeErrorInfo errorInfo;
-    TokenizeErrorType lexResult = tokenize(file, &tokens, &errorInfo);
-    fclose(file);
-    if (lexResult != LexSuccess) {
-        printf("Lex failed\n");
-        return;
+int parseGenOptions(int argc, char *argv[], GenOptions *options) {
+    options->statements = 100000;
+    options->depth = 4;
+    options->width = 4;
+    options->blockPercent = 10;
+    options->stringPercent = 20;
+    options->commentPercent = 10;
+    options->iterations = 5;
+    options->threads = 1;
+    options->nesting = 0;
+    options->seed = 1;
+    for (int i = 0; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return -1;
+        }
+        char *name = argv[i];
+        int value = atoi(argv[++i]);
+        if (strcmp(name, "--statements") == 0) {
+            options->statements = value;
+        } else if (strcmp(name, "--depth") == 0) {
+            options->depth = value;
+        } else if (strcmp(name, "--width") == 0) {
+            options->width = value > 0 ? value : 1;
+        } else if (strcmp(name, "--blocks") == 0) {
+            options->blockPercent = value;
+        } else if (strcmp(name, "--strings") == 0) {
+            options->stringPercent = value;
+        } else if (strcmp(name, "--comments") == 0) {
+            options->commentPercent = value;
+        } else if (strcmp(name, "--iterations") == 0) {
+            options->iterations = value > 0 ? value : 1;
+        } else if (strcmp(name, "--threads") == 0) {
+            options->threads = value > 0 ? value : 1;
+        } else if (strcmp(name, "--nesting") == 0) {
+            options->nesting = value;
+        } else if (strcmp(name, "--seed") == 0) {
+            options->seed = value;
+        } else {
+            return -1;
+        }
     }
+    return 0;
+}
 
-    Node *resultNode;
-    TokenList *tokensLeft;
-    
-    int result = parse(tokens, &resultNode, &tokensLeft);
-    if (result == ParseSuccess) {
-        printAST(resultNode, 0);
-    } else {
-        reportParseError(filename, result, tokensLeft);
+void printGenUsage() {
+    printf("Options for gen and bench:\n");
+    printf("  --statements N   number of statements (100000)\n");
+    printf("  --depth N        maximum if/loop nesting depth (4)\n");
+    printf("  --width N        terms per expression (4)\n");
+    printf("  --blocks P       percent of statements that open a block (10)\n");
+    printf("  --strings P      percent of statements using strings (20)\n");
+    printf("  --comments P     percent of statements preceded by a comment (10)\n");
+    printf("  --iterations N   timed runs per phase, bench only (5)\n");
+    printf("  --threads N      threads to parse on, bench only (1)\n");
+    printf("  --nesting N      instead, a valid program with blocks N deep (0)\n");
+    printf("  --seed N         random seed (1)\n");
+}
+
+void genCommand(int argc, char *argv[]) {
+    GenOptions options;
+    if (parseGenOptions(argc, argv, &options) != 0) {
+        printGenUsage();
+        exit(1);
     }
-    
+    Buffer program;
+    initBuffer(&program);
+    generateProgram(&program, &options);
+    fwrite(program.data, 1, program.len, stdout);
+    free(program.data);
 }
 
-void lexCommand(char *filename) {
-    FILE *file = fopen(filename, "r");
-    TokenList *tokens;
-    TokenizeErrorInfo errorInfo;
-    TokenizeErrorType err = tokenize(file, &tokens, &errorInfo);
-    fclose(file);
-    if (err != 0) {
-        printf("Tokenize error: %d\n", err);
-        printf("Line %d, char %d, offset %d\n", errorInfo.line, errorInfo.character, errorInfo.offset);
+// Times tokenize and parse separately over a generated program, keeping
+// the best of the iterations, and prints one JSON object so results can be
+// compared from release to release.
+void benchCommand(int argc, char *argv[]) {
+    GenOptions options;
+    if (parseGenOptions(argc, argv, &options) != 0) {
+        printGenUsage();
         exit(1);
     }
+    Buffer program;
+    initBuffer(&program);
+    generateProgram(&program, &options);
+    Source source;
+    source.data = program.data;
+    source.len = program.len;
+    source.fd = -1;
+
+    double lexBest = 0;
+    double parseBest = 0;
+    int tokenCount = 0;
+    int nodeCount = 0;
+    long lexAllocations = 0;
+    long parseAllocations = 0;
+    for (int i = 0; i < options.iterations; i++) {
+        Interner interner;
+        TokenArray tokens;
+        TokenizeErrorInfo errorInfo;
+        double start = nowSeconds();
+        initInterner(&interner);
+        if (tokenize(&source, &interner, &tokens, &errorInfo) != LexSuccess) {
+            printf("Tokenize error at line %" PRId64 ", char %" PRId64 "\n",
+                errorInfo.line, errorInfo.character);
+            exit(1);
+        }
+        double lexTime = nowSeconds() - start;
+
+        Ast ast;
+        Parser parser;
+        NodeIndex program;
+        int posLeft;
+        start = nowSeconds();
+        initAst(&ast);
+        parser.source = &source;
+        parser.tokens = &tokens;
+        parser.ast = &ast;
+        parser.interner = &interner;
+        if (parseParallel(&parser, options.threads, &program, &posLeft) != ParseSuccess) {
+            printf("Parse error at line %d\n", tokenLine(&tokens, posLeft));
+            exit(1);
+        }
+        double parseTime = nowSeconds() - start;
 
-    while (tokens != NULL) {
-        printToken(tokens->token, 0);
-        tokens = tokens->next;
+        if (i == 0 || lexTime < lexBest) {
+            lexBest = lexTime;
+        }
+        if (i == 0 || parseTime < parseBest) {
+            parseBest = parseTime;
+        }
+        int counts[BreakStatement + 1] = { 0 };
+        countNodes(&ast, program, counts);
+        nodeCount = 0;
+        for (int type = 0; type <= BreakStatement; type++) {
+            nodeCount += counts[type];
+        }
+        tokenCount = tokens.count;
+        lexAllocations = tokens.allocations + interner.allocations;
+        parseAllocations = ast.allocations;
+        freeAst(&ast);
+        freeTokenArray(&tokens);
+        freeInterner(&interner);
     }
+
+    printf("{\"statements\":%d,\"depth\":%d,\"width\":%d,\"blocks\":%d,"
+        "\"strings\":%d,\"comments\":%d,\"seed\":%u,\"iterations\":%d,\"threads\":%d,"
+        "\"bytes\":%zu,\"tokens\":%d,\"nodes\":%d,"
+        "\"lexSeconds\":%.6f,\"parseSeconds\":%.6f,"
+        "\"lexMBPerSec\":%.2f,\"lexTokensPerSec\":%.0f,"
+        "\"parseTokensPerSec\":%.0f,\"parseNodesPerSec\":%.0f,"
+        "\"lexAllocsPerToken\":%.6f,\"parseAllocsPerToken\":%.6f}\n",
+        options.statements, options.depth, options.width, options.blockPercent,
+        options.stringPercent, options.commentPercent, options.seed, options.iterations,
+        options.threads, source.len, tokenCount, nodeCount,
+        lexBest, parseBest,
+        source.len / lexBest / 1e6, tokenCount / lexBest,
+        tokenCount / parseBest, nodeCount / parseBest,
+        (double)lexAllocations / tokenCount, (double)parseAllocations / tokenCount
+    );
+    free(program.data);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        printf("Usage: pipa <command> <filename>\n");
-        printf("  where command is one of: lex and parse\n");
+    if (argc >= 2 && strcmp(argv[1], "gen") == 0) {
+        genCommand(argc - 2, argv + 2);
+        return 0;
+    } else if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        benchCommand(argc - 2, argv + 2);
+        return 0;
+    }
+    // --stats, --jobs, --threads, --cache and --format may appear anywhere
+    // after the command
+    int showStats = 0;
+    int jobs = 0;
+    FileOptions options;
+    options.threads = 1;
+    options.cacheDir = NULL;
+    options.format = DumpText;
+    int argCount = 0;
+    for (int i = 0; i < argc; i++) {
+        if (i > 0 && strcmp(argv[i], "--stats") == 0) {
+            showStats = 1;
+        } else if (i > 0 && strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+            if (jobs < 1) {
+                jobs = 1;
+            }
+        } else if (i > 0 && strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.threads = atoi(argv[++i]);
+        } else if (i > 0 && strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            options.cacheDir = argv[++i];
+        } else if (i > 0 && strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            char *format = argv[++i];
+            if (strcmp(format, "text") == 0) {
+                options.format = DumpText;
+            } else if (strcmp(format, "json") == 0) {
+                options.format = DumpJson;
+            } else if (strcmp(format, "sexp") == 0) {
+                options.format = DumpSexp;
+            } else {
+                printf("Unknown format %s, expected text, json or sexp\n", format);
+                exit(1);
+            }
+        } else {
+            argv[argCount++] = argv[i];
+        }
+    }
+    argc = argCount;
+    if (argc < 2) {
+        printf("Usage: pipa <command> [--stats] [--threads <n>] [<filename>]\n");
+        printf("       pipa lex|parse --jobs <n> [<filename>...]\n");
+        printf("       pipa parse --cache <dir> [<filename>...]\n");
+        printf("       pipa lex|parse --format text|json|sexp [<filename>]\n");
+        printf("       pipa gen|bench [options]\n");
+        printf("  where command is one of: lex, parse, run, compile, jit and edit\n");
+        printf("  and the source is read from stdin when filename is - or missing;\n");
+        printf("  with --jobs or several files, files are run in parallel and their\n");
+        printf("  names are read from stdin when none are given; with --cache, parses\n");
+        printf("  are saved to and loaded from dir, keyed by the file contents\n");
         exit(1);
     }
 
     char* command = argv[1];
-    char* filename = argv[2];
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        printf("Failed to open %s\n", filename);
-        exit(1);
+    FileRunner runner = strcmp(command, "lex") == 0 ? lexFile :
+        strcmp(command, "parse") == 0 ? parseFile : NULL;
+    if (runner != NULL && (jobs > 0 || argc > 3)) {
+        if (jobs == 0) {
+            jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        batchCommand(runner, &options, argv + 2, argc - 2, jobs);
+        return 0;
     }
+    char* filename = argc >= 3 ? argv[2] : "-";
+    Stats stats;
+    memset(&stats, 0, sizeof (Stats));
+    Stats *statsOut = showStats ? &stats : NULL;
     if (strcmp(command, "lex") == 0) {
-        lexCommand(filename);
+        lexCommand(filename, statsOut, &options);
     } else if (strcmp(command, "parse") == 0) {
-        parseCommand(filename);
+        parseCommand(filename, statsOut, &options);
+    } else if (strcmp(command, "run") == 0) {
+        runCommand(filename, statsOut);
+    } else if (strcmp(command, "compile") == 0) {
+        compileCommand(filename, statsOut);
+    } else if (strcmp(command, "jit") == 0) {
+        jitCommand(filename, statsOut);
+    } else if (strcmp(command, "edit") == 0) {
+        editCommand(filename);
+    }
+    if (showStats) {
+        printStats(&stats);
     }
 }